@@ -0,0 +1,94 @@
+// Runs a ROM headless through the cpu and memory only, to time the interpreter on a real instruction mix.
+// Build with make bench, which produces one binary with the branchy ALU helpers and one with CPU_ALU_TABLES.
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "config.h"
+#include "cartridge.h"
+#include "cpu.h"
+#include "em_memory.h"
+#include "emulator.h"
+#include "graphics.h"
+
+// Stand ins for the emulator, interrupts are never serviced so the run only depends on the ROM
+static int _bench_clock_speed = 1024;
+
+void emulator_disable_interupts() { cpu_end_run(); }
+void emulator_enable_interrupts() { cpu_end_run(); }
+void emulator_enable_interrupts_immediate() { cpu_end_run(); }
+void emulator_request_interrupts(BYTE interrupt_bit) { (void)interrupt_bit; }
+int emulator_get_clock_speed() { return _bench_clock_speed; }
+void emulator_set_clock_speed(int new_speed) { _bench_clock_speed = new_speed; }
+void emulator_halt() { cpu_end_run(); }
+void emulator_start_serial_transfer() {}
+void emulator_start_oam_dma() { memory_finish_oam_dma(); }
+BYTE emulator_read_divider() { return 0; }
+void emulator_reset_divider() {}
+BYTE emulator_read_timer() { return 0; }
+void emulator_write_timer(BYTE data) { (void)data; }
+void graphics_register_written(WORD address) { (void)address; }
+
+static double _bench_seconds()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2)
+    {
+        printf("Usage: %s <rom> [frames]\n", argv[0]);
+        return 1;
+    }
+    long frames = argc > 2 ? atol(argv[2]) : 6000;
+
+    BYTE *address_space = (BYTE *)calloc(0x10000, sizeof(BYTE));
+    memory_init(address_space, NULL);
+    if (!cartridge_load(argv[1]))
+    {
+        return 1;
+    }
+    cpu_intialize();
+    memory_skip_boot();
+    cpu_skip_boot();
+
+    // Only LY is advanced, enough for the usual wait for vblank loops to make progress. Like the emulator the cpu runs
+    // freely up to that event.
+    const int cycles_per_frame = CPU_CLOCK_SPEED / FRAME_RATE;
+    long long total = 0;
+    int scanline_cycles = 0;
+    double start = _bench_seconds();
+    for (long frame = 0; frame < frames; frame++)
+    {
+        int cycles = 0;
+        while (cycles < cycles_per_frame)
+        {
+            int taken = cpu_run(SCANLINE_CLOCK_CYCLES - scanline_cycles);
+            cycles += taken;
+            scanline_cycles += taken;
+            if (scanline_cycles >= SCANLINE_CLOCK_CYCLES)
+            {
+                scanline_cycles -= SCANLINE_CLOCK_CYCLES;
+                BYTE scanline = memory_direct_read(SCANLINE_ADDRESS) + 1;
+                memory_direct_write(SCANLINE_ADDRESS, scanline > TOTAL_SCANLINES ? 0 : scanline);
+            }
+        }
+        total += cycles;
+    }
+    double elapsed = _bench_seconds() - start;
+
+    // Same work checksum for every build, differing sums mean the cores disagree
+    unsigned int sum = 0;
+    for (int address = 0x8000; address < 0x10000; address++)
+    {
+        sum = sum * 31 + memory_direct_read(address);
+    }
+
+    printf("%lld cycles in %.3fs, %.1fx real time, memory sum %08x\n", total, elapsed,
+           total / (double)CPU_CLOCK_SPEED / elapsed, sum);
+    return 0;
+}
@@ -0,0 +1,95 @@
+// Runs the PPU alone over a fixed scene, to time scanline rendering and frame conversion without the cpu in the way.
+// Build with make bench, which produces one binary with the SIMD scanline code and one with GRAPHICS_SCALAR.
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "config.h"
+#include "cpu.h"
+#include "em_memory.h"
+#include "emulator.h"
+#include "graphics.h"
+#include "scheduler.h"
+
+// Stand ins for the emulator, the PPU only requests interrupts and nothing services them
+static int _bench_clock_speed = 1024;
+
+void emulator_disable_interupts() {}
+void emulator_enable_interrupts() {}
+void emulator_enable_interrupts_immediate() {}
+void emulator_request_interrupts(BYTE interrupt_bit) { (void)interrupt_bit; }
+int emulator_get_clock_speed() { return _bench_clock_speed; }
+void emulator_set_clock_speed(int new_speed) { _bench_clock_speed = new_speed; }
+void emulator_halt() {}
+void emulator_start_serial_transfer() {}
+void emulator_start_oam_dma() { memory_finish_oam_dma(); }
+BYTE emulator_read_divider() { return 0; }
+void emulator_reset_divider() {}
+BYTE emulator_read_timer() { return 0; }
+void emulator_write_timer(BYTE data) { (void)data; }
+
+static double _bench_seconds()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// The same pseudo random tiles, maps and sprites on every run, so the checksums of different builds can be compared
+static void _bench_fill_scene()
+{
+    unsigned int seed = 1;
+    for (int address = 0x8000; address < 0xA000; address++)
+    {
+        seed = seed * 1103515245 + 12345;
+        memory_write(address, seed >> 16);
+    }
+    for (int sprite = 0; sprite < 40; sprite++)
+    {
+        memory_direct_write(0xFE00 + sprite * 4, 16 + (sprite * 13) % 150);
+        memory_direct_write(0xFE00 + sprite * 4 + 1, 8 + (sprite * 37) % 165);
+        memory_direct_write(0xFE00 + sprite * 4 + 2, sprite * 5);
+        memory_direct_write(0xFE00 + sprite * 4 + 3, (sprite * 0x10) & 0xF0);
+    }
+    memory_write(BACKGROUND_PALETTE_ADDRESS, 0xE4);
+    memory_write(SPRITE_PALETTE_0_ADDRESS, 0xD2);
+    memory_write(SPRITE_PALETTE_1_ADDRESS, 0x1B);
+    memory_direct_write(0xFF4A, 40);
+    memory_direct_write(0xFF4B, 87);
+}
+
+int main(int argc, char **argv)
+{
+    long frames = argc > 1 ? atol(argv[1]) : 6000;
+
+    BYTE *address_space = (BYTE *)calloc(0x10000, sizeof(BYTE));
+    memory_init(address_space, NULL);
+    scheduler_init();
+    graphics_init();
+    _bench_fill_scene();
+    memory_write(LCD_CONTROL_ADDRESS, 0xF3);
+
+    uint32_t *pixels = (uint32_t *)calloc(SCREEN_HEIGHT * SCREEN_WIDTH, sizeof(uint32_t));
+
+    // Scrolls every frame and rewrites a tile now and then, so the tile cache sees some work too
+    const int cycles_per_frame = SCANLINE_CLOCK_CYCLES * (TOTAL_SCANLINES + 1);
+    unsigned int sum = 0;
+    double start = _bench_seconds();
+    for (long frame = 0; frame < frames; frame++)
+    {
+        memory_direct_write(0xFF43, frame);
+        memory_direct_write(0xFF42, frame / 2);
+        memory_write(0x8010 + frame % 16, frame);
+        scheduler_advance(cycles_per_frame);
+        graphics_convert_frame(pixels);
+        sum = sum * 31 + pixels[frame % (SCREEN_HEIGHT * SCREEN_WIDTH)];
+    }
+    double elapsed = _bench_seconds() - start;
+
+    for (int pixel = 0; pixel < SCREEN_HEIGHT * SCREEN_WIDTH; pixel++)
+    {
+        sum = sum * 31 + pixels[pixel];
+    }
+
+    printf("%ld frames in %.3fs, %.1f frames per second, screen sum %08x\n", frames, elapsed, frames / elapsed, sum);
+    return 0;
+}
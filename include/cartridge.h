@@ -0,0 +1,29 @@
+#ifndef CARTRIDGE_H
+#define CARTRIDGE_H
+
+#include <stdbool.h>
+#include "config.h"
+
+// Maps the ROM file at path read only, so every emulator loading the same file shares its pages, and maps bank 0 and 1
+// into memory. Only as much of the file as the header declares is used. memory_init has to be called first. Prints why
+// and returns false if the ROM can not be used.
+bool cartridge_load(const char *path);
+void cartridge_close();
+
+// Battery backed RAM lives in a .sav file next to the ROM, mapped shared so the kernel holds every write even if the
+// emulator crashes. This writes back the pages changed since the last call, waiting for the disk only if wait is set.
+void cartridge_flush_save(bool wait);
+
+// Source of MBC3 clock time in seconds. The host clock follows the wall clock and catches up on the time the emulator
+// was closed, an emulated clock keeps in-game time in step with emulated time however fast the emulator runs. Set it
+// before loading the cartridge.
+typedef long long (*cartridge_clock)();
+long long cartridge_host_clock();
+void cartridge_set_clock(cartridge_clock clock);
+
+// The whole ROM image, for the header
+const BYTE *cartridge_rom();
+
+// ROM bank currently mapped at address, 0x0000-0x7FFF
+int cartridge_rom_bank(WORD address);
+#endif
@@ -19,6 +19,18 @@ static const int SCREEN_HEIGHT = 144;
 
 static const int CPU_CLOCK_SPEED = 4194304;
 
+// Cartridge header
+#define CARTRIDGE_TYPE_ADDRESS 0x147
+#define CARTRIDGE_ROM_SIZE_ADDRESS 0x148
+#define CARTRIDGE_RAM_SIZE_ADDRESS 0x149
+#define ROM_BANK_SIZE 0x4000
+#define RAM_BANK_SIZE 0x2000
+// How often the pages of a battery backed save that changed are written back, unless --save-flush gives another count
+#define SAVE_FLUSH_FRAMES 60
+
+// Per ROM idle loops, see idle_loops.h
+#define IDLE_LOOP_DATABASE "idle_loops.txt"
+
 #define FLAG_Z 7
 #define FLAG_N 6
 #define FLAG_H 5
@@ -32,6 +44,10 @@ static const int CPU_CLOCK_SPEED = 4194304;
 
 #define LCD_CONTROL_ADDRESS 0xFF40
 #define LCD_STATUS_ADDRESS 0xFF41
+#define LCD_COMPARE_ADDRESS 0xFF45
+#define BACKGROUND_PALETTE_ADDRESS 0xFF47
+#define SPRITE_PALETTE_0_ADDRESS 0xFF48
+#define SPRITE_PALETTE_1_ADDRESS 0xFF49
 
 #define LCD_ENABLED_BIT 7
 #define LCD_WINDOW_TILE_ID_LOCATION_BIT 6
@@ -57,12 +73,23 @@ typedef enum COLOUR
 #define JOYPAD_INTERRUPT 4
 
 #define INTERRUPT_REGISTER_ADDRESS 0xFF0F
+#define INTERRUPT_ENABLED_ADDRESS 0xFFFF
 
 #define DMA_ADDRESS 0xFF46
+// 160 machine cycles
+#define DMA_TRANSFER_CYCLES 640
+#define BOOT_ROM_DISABLE_ADDRESS 0xFF50
 
 // Timer Info
 #define TIMA 0xFF05
 #define TMA 0xFF06
 #define TIMER_CONTROLLER_ADDRESS 0xFF07
 #define DIVIDER_REGISTER_ADDRESS 0xFF04
+#define DIVIDER_CLOCK_CYCLES 256
+
+// Serial
+#define SERIAL_DATA_ADDRESS 0xFF01
+#define SERIAL_CONTROL_ADDRESS 0xFF02
+// 8 bits at 8192 Hz on the internal clock
+#define SERIAL_TRANSFER_CYCLES 4096
 #endif
\ No newline at end of file
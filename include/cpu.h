@@ -1,6 +1,7 @@
 #ifndef CPU_H
 #define CPU_H
 
+#include <stdbool.h>
 #include "config.h"
 
 union cpu_register
@@ -26,7 +27,21 @@ struct cpu_context
 };
 
 void cpu_intialize();
+void cpu_skip_boot();
 int cpu_next_execute_instruction();
+int cpu_reference_execute_instruction();
+int cpu_run(int cycle_budget);
+void cpu_end_run();
+// Cycles the current cpu_run has used before the instruction executing now, 0 outside a run
+int cpu_run_elapsed();
+void cpu_code_written(WORD address);
+void cpu_flush_code_cache();
+// Marks the loop starting at pc as idle even if the cpu cannot prove it, see idle_loops.h
+void cpu_add_idle_loop(WORD pc, int bank);
+// Cycles of one iteration when the last cpu_run stopped because the cpu is spinning in an idle loop, otherwise 0.
+// until_interrupt is set when the loop only polls RAM, so only an interrupt handler can end it.
+int cpu_idle_cycles(bool *until_interrupt);
+// The loop running now read something that changes without an event, like DIV, so it is not idle
+void cpu_reset_idle();
 void cpu_interrupt(WORD interrupt_address);
-void temp_print_registers();
 #endif
\ No newline at end of file
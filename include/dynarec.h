@@ -0,0 +1,44 @@
+#ifndef DYNAREC_H
+#define DYNAREC_H
+
+#include <stdbool.h>
+#include "config.h"
+#include "cpu.h"
+
+#if defined(CPU_DYNAREC) && !defined(__x86_64__)
+#error "CPU_DYNAREC emits x86-64 code"
+#endif
+
+// Times a block is entered before it gets compiled
+#define DYNAREC_THRESHOLD 16
+// Longest a compiled prefix may run, native code only checks for scheduler events between blocks
+#define DYNAREC_MAX_BLOCK_CYCLES 64
+
+// One decoded guest instruction, as handed over by the cpu's block cache
+struct dynarec_instruction
+{
+    BYTE opcode;
+    BYTE length;
+    BYTE cycles;
+    WORD operand;
+};
+
+// Native code for a prefix of a block. Runs with the guest registers pinned in host registers, writes them back along
+// with PC on exit and returns the cycles taken. executed is set to the number of guest instructions that ran, which is
+// less than the compiled prefix when an instruction touching I/O has to be left to the interpreter.
+typedef int (*dynarec_block)(struct cpu_context *cpu, int *executed);
+
+void dynarec_init();
+void dynarec_flush();
+bool dynarec_has_space();
+
+// Compiles the longest supported prefix of the instructions starting at pc, NULL if the first one is not supported.
+// compiled is set to the length of the prefix and max_cycles to the most cycles the native code can take.
+dynarec_block dynarec_compile(WORD pc, const struct dynarec_instruction *instructions, int count, int *compiled,
+                              int *max_cycles);
+
+// Lockstep mode, memory written by native code is journaled so the block can be replayed by the interpreter
+void dynarec_journal_begin();
+void dynarec_journal_undo();
+bool dynarec_journal_matches();
+#endif
@@ -4,11 +4,67 @@
 #include <stdbool.h>
 #include "config.h"
 
+// boot is mapped over 0x0000-0x00FF until the game writes to BOOT_ROM_DISABLE_ADDRESS, NULL to start without one
 void memory_init(BYTE *mem, BYTE *boot);
+void memory_skip_boot();
+
+typedef BYTE (*memory_read_handler)(WORD address);
+typedef void (*memory_write_handler)(WORD address, BYTE data);
+
+// Maps the 256 byte aligned range [address, address + size) to host memory. A NULL read or write pointer sends that
+// access to the handler instead. Used by the cartridge to switch banks without copying.
+void memory_map(WORD address, int size, BYTE *read, BYTE *write, memory_read_handler read_handler,
+                memory_write_handler write_handler);
 
 BYTE memory_read(WORD address);
 void memory_write(WORD address, BYTE data);
 
+// Bank number used to key decoded code, the boot rom gets its own
+#define MEMORY_BOOT_BANK -1
+int memory_code_bank(WORD address);
+// Writes to the page holding address go through cpu_code_written from now on, the cpu calls it for code it decoded from RAM
+void memory_protect_code(WORD address);
+
+// Watchpoints call callback, or print the access if it is NULL, whenever the game accesses [first, last] in one of the
+// ways set in access. Only the pages they cover leave the direct path, memory not watched costs nothing extra. Reads
+// include the cpu fetching code, which for cached code is only when it is decoded. Execute watchpoints fire before the
+// instruction runs, a callback can cpu_end_run to stop right after it. The hardware is never watched.
+#define MEMORY_WATCHPOINTS_MAX 16
+#define MEMORY_WATCH_READ 0x01
+#define MEMORY_WATCH_WRITE 0x02
+#define MEMORY_WATCH_EXECUTE 0x04
+
+typedef void (*memory_watch_callback)(WORD address, BYTE data, int access);
+
+// Returns the id to remove it with, -1 when all MEMORY_WATCHPOINTS_MAX are in use
+int memory_add_watchpoint(WORD first, WORD last, int access, memory_watch_callback callback);
+void memory_remove_watchpoint(int watchpoint);
+
+// For the cpu, which calls memory_watch_execute before running an instruction memory_execute_watched is true for
+bool memory_execute_watched(WORD address);
+void memory_watch_execute(WORD address);
+
+// VRAM written since the renderer last took it, one bit per tile in 0x8000-0x97FF and per entry of the two tile maps
+// at 0x9800 and 0x9C00. Caches built from VRAM only need to redo what is marked here.
+#define MEMORY_VRAM_TILES 384
+#define MEMORY_TILE_MAP_SIZE 0x400
+
+struct memory_vram_dirty
+{
+    bool any;
+    BYTE tiles[MEMORY_VRAM_TILES / 8];
+    BYTE maps[2][MEMORY_TILE_MAP_SIZE / 8];
+};
+
+// Copies the dirty bits into dirty and clears them
+void memory_take_vram_dirty(struct memory_vram_dirty *dirty);
+
+// Ends the OAM DMA emulator_start_oam_dma was asked to time, only MEMORY_ACCURATE_DMA builds start one. Other builds
+// copy the sprite attributes as soon as the game writes DMA_ADDRESS.
+void memory_finish_oam_dma();
+// True while a MEMORY_ACCURATE_DMA transfer hides address from the cpu
+bool memory_dma_blocks(WORD address);
+
 // ONLY USED WHEN THE HARDWARE CHAGES MEMORY AND NOT THE GAME
 void memory_direct_write(WORD address, BYTE data);
 BYTE memory_direct_read(WORD address);
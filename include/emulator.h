@@ -10,11 +10,19 @@
 struct emulator_context
 {
     bool quit;
+    // Run as fast as the host allows instead of at FRAME_RATE
+    bool turbo;
+    // Frames between writing back the save, 0 leaves it to the kernel until the emulator closes
+    int save_flush_frames;
     bool halted;
+    // Iteration length of an idle loop polling RAM, the CPU is not run again until an interrupt is serviced
+    int idle_loop_cycles;
+    // DIV and TIMA are worked out from the cycle count when read, so a halted cpu only wakes for the TIMA overflow
+    long long divider_start;
+    bool timer_enabled;
     int timer_clocks_per_increment;
-    // Both timer and divider store clocks cycles to / from incrementing their respective registers
-    int timer;
-    int divider;
+    long long timer_start;
+    BYTE timer_value;
 
     bool master_interupt;
     int disable_pending;
@@ -22,6 +30,10 @@ struct emulator_context
 
     SDL_Window *window;
     SDL_Renderer *renderer;
+    // Streaming texture the frame is uploaded to, in the ARGB8888 graphics_convert_frame produces
+    SDL_Texture *screen;
+    // SCREEN_HEIGHT * SCREEN_WIDTH pixels, allocated with the texture
+    uint32_t *frame;
 };
 
 void emulator_run(int argc, char **argv);
@@ -33,5 +45,11 @@ void emulator_request_interrupts(BYTE interrupt_bit);
 
 int emulator_get_clock_speed();
 void emulator_set_clock_speed(int new_speed);
+void emulator_start_serial_transfer();
+void emulator_start_oam_dma();
+BYTE emulator_read_divider();
+void emulator_reset_divider();
+BYTE emulator_read_timer();
+void emulator_write_timer(BYTE data);
 void emulator_halt();
 #endif
\ No newline at end of file
@@ -5,13 +5,30 @@
 
 struct graphics_context
 {
-    int scanline_counter;
+    bool lcd_enabled;
 
-    // Stores the RGB values for each pixel. hXw layout to reduce memory accesses since gameboy renders in column order.
-    BYTE screen_data[SCREEN_HEIGHT][SCREEN_WIDTH][3];
+    // Colour index of each pixel, palette * 4 + DMG shade, with GRAPHICS_BACKGROUND_COLOUR_0 where the background has
+    // colour number 0. hXw layout to reduce memory accesses since gameboy renders in column order.
+    BYTE screen_data[SCREEN_HEIGHT][SCREEN_WIDTH];
+};
+
+#define GRAPHICS_BACKGROUND_COLOUR_0 0x10
+
+// Palettes by register, BGP, OBP0 and OBP1
+enum graphics_palette
+{
+    GRAPHICS_BACKGROUND_PALETTE,
+    GRAPHICS_SPRITE_PALETTE_0,
+    GRAPHICS_SPRITE_PALETTE_1,
+    GRAPHICS_PALETTE_COUNT
 };
 
 void graphics_init();
-void graphics_update(int cycles);
-BYTE graphics_get_screen_data(int col, int row, int colour);
+
+// RGB of the four shades when drawn through palette, greys by default. Giving each palette its own colours colourises
+// games the way a GBC does for DMG cartridges.
+void graphics_set_colours(enum graphics_palette palette, const BYTE colours[4][3]);
+void graphics_register_written(WORD address);
+// Fills pixels with the SCREEN_HEIGHT rows of SCREEN_WIDTH ARGB8888 pixels currently on screen
+void graphics_convert_frame(uint32_t *pixels);
 #endif
\ No newline at end of file
@@ -0,0 +1,11 @@
+#ifndef IDLE_LOOPS_H
+#define IDLE_LOOPS_H
+
+#include "config.h"
+
+// Adds the idle loops listed for the loaded cartridge. Each line of the database is
+// "header_checksum global_checksum bank address title" with the numbers in hex, the checksums at 0x14D-0x14F of the
+// cartridge header pick the ROM and the title is only there for whoever edits the file. Lines starting with # are
+// comments, a missing database is not an error.
+void idle_loops_load(const char *path, const BYTE *cartridge);
+#endif
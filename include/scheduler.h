@@ -0,0 +1,35 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <stdbool.h>
+#include "config.h"
+
+// Peripherals register the cycle of their next state change, the CPU runs freely until the nearest one
+enum scheduler_event
+{
+    SCHEDULER_PPU,
+    SCHEDULER_TIMER,
+    SCHEDULER_SERIAL,
+    SCHEDULER_DMA,
+    SCHEDULER_EVENT_COUNT
+};
+
+typedef void (*scheduler_callback)();
+
+void scheduler_init();
+
+// Cycles since power on. While a callback runs this is the cycle its event was due, so rescheduling from it does not drift.
+// During cpu_run it is the cycle the current instruction started.
+long long scheduler_now();
+
+// Replaces any pending deadline for event, counting from scheduler_now
+void scheduler_schedule(enum scheduler_event event, int cycles_from_now, scheduler_callback callback);
+void scheduler_cancel(enum scheduler_event event);
+bool scheduler_is_pending(enum scheduler_event event);
+
+// Cycles the CPU can run before the nearest event is due
+int scheduler_cycles_until_next();
+
+// Moves the clock forward, firing every event that falls due in timestamp order
+void scheduler_advance(int cycles);
+#endif
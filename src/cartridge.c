@@ -0,0 +1,604 @@
+#include <assert.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "cartridge.h"
+#include "em_memory.h"
+#include "cpu.h"
+
+// Saved after the RAM like most emulators do: the live and latched seconds, minutes, hours, day low and day high as
+// 32 bit little endian words, then the host time in seconds as a 64 bit one
+#define CARTRIDGE_RTC_REGISTERS 5
+#define CARTRIDGE_RTC_FOOTER_SIZE 48
+#define CARTRIDGE_RTC_SECONDS_PER_DAY (24 * 60 * 60)
+#define CARTRIDGE_RTC_DAYS 512
+
+enum cartridge_mbc
+{
+    CARTRIDGE_NO_MBC,
+    CARTRIDGE_MBC1,
+    CARTRIDGE_MBC3,
+    CARTRIDGE_MBC5
+};
+
+struct cartridge_context
+{
+    enum cartridge_mbc mbc;
+    BYTE *rom;
+    size_t rom_size;
+    int rom_banks;
+    BYTE *ram;
+    int ram_banks;
+
+    // Battery backed RAM is the mapped .sav file, ram followed by the clock footer if there is a clock. Pages changed
+    // since the last flush are marked in dirty, one entry per host page.
+    bool battery;
+    size_t ram_size;
+    size_t save_size;
+    size_t host_page_size;
+    bool *dirty;
+
+    // MBC3 clock. The counter is kept in seconds as of the clock reading base, the registers are derived from it.
+    bool rtc;
+    cartridge_clock clock;
+    long long rtc_base;
+    long long rtc_seconds;
+    bool rtc_halted;
+    bool rtc_carry;
+    BYTE rtc_latched[CARTRIDGE_RTC_REGISTERS];
+    bool rtc_latch_armed;
+
+    // Registers as the game last wrote them
+    bool ram_enabled;
+    int rom_bank;
+    // MBC1 only, the 2 bit register that selects the RAM bank or the upper ROM bank bits depending on mode
+    int upper_bank;
+    int ram_bank;
+    bool mode;
+
+    // Banks mapped right now, a write that leaves them unchanged does not touch the page table
+    int low_bank;
+    int high_bank;
+    BYTE *ram_mapped;
+    bool rtc_mapped;
+    // Pages of the mapped battery bank a write has let through since it was mapped or flushed
+    bool ram_writable[RAM_BANK_SIZE / 0x100];
+};
+
+static struct cartridge_context _cartridge = {.clock = cartridge_host_clock};
+
+static void _cartridge_write_rom(WORD address, BYTE data);
+
+// RAM that is disabled or missing reads as an open bus and drops writes
+static BYTE _cartridge_read_disabled(WORD address)
+{
+    (void)address;
+    return 0xFF;
+}
+
+static void _cartridge_write_disabled(WORD address, BYTE data)
+{
+    (void)address;
+    (void)data;
+}
+
+static void _cartridge_mark_dirty(BYTE *data)
+{
+    _cartridge.dirty[(data - _cartridge.ram) / _cartridge.host_page_size] = true;
+}
+
+// Battery RAM is mapped read only until a page is written, the first write marks it dirty and lets the rest through
+static void _cartridge_write_save(WORD address, BYTE data)
+{
+    BYTE *page = &_cartridge.ram_mapped[(address - 0xA000) & 0xFF00];
+    page[address & 0xFF] = data;
+    _cartridge_mark_dirty(page);
+    _cartridge.ram_writable[(address - 0xA000) >> 8] = true;
+    memory_map(address & 0xFF00, 0x100, page, page, _cartridge_read_disabled, _cartridge_write_save);
+}
+
+long long cartridge_host_clock()
+{
+    return time(NULL);
+}
+
+void cartridge_set_clock(cartridge_clock clock)
+{
+    _cartridge.clock = clock;
+}
+
+// Folds the time passed since rtc_base into the counter, wrapping the day counter into the carry bit
+static void _cartridge_rtc_update()
+{
+    long long now = _cartridge.clock();
+    if (!_cartridge.rtc_halted && now > _cartridge.rtc_base)
+    {
+        _cartridge.rtc_seconds += now - _cartridge.rtc_base;
+    }
+    _cartridge.rtc_base = now;
+
+    const long long wrap = (long long)CARTRIDGE_RTC_DAYS * CARTRIDGE_RTC_SECONDS_PER_DAY;
+    if (_cartridge.rtc_seconds >= wrap)
+    {
+        _cartridge.rtc_seconds %= wrap;
+        _cartridge.rtc_carry = true;
+    }
+}
+
+static void _cartridge_rtc_registers(BYTE registers[CARTRIDGE_RTC_REGISTERS])
+{
+    _cartridge_rtc_update();
+    long long seconds = _cartridge.rtc_seconds;
+    int days = seconds / CARTRIDGE_RTC_SECONDS_PER_DAY;
+
+    registers[0] = seconds % 60;
+    registers[1] = seconds / 60 % 60;
+    registers[2] = seconds / 3600 % 24;
+    registers[3] = days & 0xFF;
+    registers[4] = (days >> 8) | (_cartridge.rtc_halted ? 0x40 : 0x00) | (_cartridge.rtc_carry ? 0x80 : 0x00);
+}
+
+static void _cartridge_rtc_set(const BYTE registers[CARTRIDGE_RTC_REGISTERS])
+{
+    int days = registers[3] | ((registers[4] & 0x01) << 8);
+    _cartridge.rtc_seconds = ((days * 24LL + (registers[2] & 0x1F)) * 60 + (registers[1] & 0x3F)) * 60 +
+                             (registers[0] & 0x3F);
+    _cartridge.rtc_halted = registers[4] & 0x40;
+    _cartridge.rtc_carry = registers[4] & 0x80;
+    _cartridge.rtc_base = _cartridge.clock();
+}
+
+static void _cartridge_rtc_save()
+{
+    if (!_cartridge.battery)
+    {
+        return;
+    }
+    BYTE *footer = &_cartridge.ram[_cartridge.ram_size];
+    BYTE registers[CARTRIDGE_RTC_REGISTERS];
+    _cartridge_rtc_registers(registers);
+
+    memset(footer, 0, CARTRIDGE_RTC_FOOTER_SIZE);
+    for (int i = 0; i < CARTRIDGE_RTC_REGISTERS; i++)
+    {
+        footer[i * 4] = registers[i];
+        footer[(CARTRIDGE_RTC_REGISTERS + i) * 4] = _cartridge.rtc_latched[i];
+    }
+    long long timestamp = cartridge_host_clock();
+    for (int i = 0; i < 8; i++)
+    {
+        footer[40 + i] = timestamp >> (i * 8);
+    }
+    _cartridge_mark_dirty(footer);
+    _cartridge_mark_dirty(footer + CARTRIDGE_RTC_FOOTER_SIZE - 1);
+}
+
+// Only the host clock can tell how long the emulator was closed, an emulated one continues where it stopped
+static void _cartridge_rtc_load()
+{
+    if (!_cartridge.battery)
+    {
+        _cartridge_rtc_set((const BYTE[CARTRIDGE_RTC_REGISTERS]){0});
+        return;
+    }
+    const BYTE *footer = &_cartridge.ram[_cartridge.ram_size];
+    BYTE registers[CARTRIDGE_RTC_REGISTERS];
+    for (int i = 0; i < CARTRIDGE_RTC_REGISTERS; i++)
+    {
+        registers[i] = footer[i * 4];
+        _cartridge.rtc_latched[i] = footer[(CARTRIDGE_RTC_REGISTERS + i) * 4];
+    }
+    long long timestamp = 0;
+    for (int i = 0; i < 8; i++)
+    {
+        timestamp |= (long long)footer[40 + i] << (i * 8);
+    }
+    _cartridge_rtc_set(registers);
+
+    long long now = cartridge_host_clock();
+    if (_cartridge.clock == cartridge_host_clock && !_cartridge.rtc_halted && timestamp > 0 && now > timestamp)
+    {
+        _cartridge.rtc_seconds += now - timestamp;
+    }
+}
+
+// The game reads the registers as they were at the last latch
+static BYTE _cartridge_read_rtc(WORD address)
+{
+    (void)address;
+    return _cartridge.rtc_latched[_cartridge.ram_bank - 0x08];
+}
+
+static void _cartridge_write_rtc(WORD address, BYTE data)
+{
+    (void)address;
+    BYTE registers[CARTRIDGE_RTC_REGISTERS];
+    _cartridge_rtc_registers(registers);
+    registers[_cartridge.ram_bank - 0x08] = data;
+    _cartridge_rtc_set(registers);
+    _cartridge_rtc_save();
+}
+
+// Writing 0 then 1 copies the running clock into the registers the game reads
+static void _cartridge_latch_rtc(BYTE data)
+{
+    if (_cartridge.rtc_latch_armed && data == 0x01)
+    {
+        _cartridge_rtc_registers(_cartridge.rtc_latched);
+        _cartridge_rtc_save();
+    }
+    _cartridge.rtc_latch_armed = data == 0x00;
+}
+
+static bool _cartridge_has_rtc(BYTE type)
+{
+    return type == 0x0F || type == 0x10;
+}
+
+static bool _cartridge_has_battery(BYTE type)
+{
+    switch (type)
+    {
+    case 0x03:
+    case 0x06:
+    case 0x09:
+    case 0x0D:
+    case 0x0F:
+    case 0x10:
+    case 0x13:
+    case 0x1B:
+    case 0x1E:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// rom.gb saves to rom.sav
+static BYTE *_cartridge_map_save(const char *rom_path, size_t size)
+{
+    char *path = (char *)malloc(strlen(rom_path) + 5);
+    strcpy(path, rom_path);
+    char *extension = strrchr(path, '.');
+    if (extension == NULL || strchr(extension, '/') != NULL)
+    {
+        extension = path + strlen(path);
+    }
+    strcpy(extension, ".sav");
+
+    BYTE *ram = NULL;
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    struct stat info;
+    if (fd >= 0 && fstat(fd, &info) == 0 && (info.st_size >= (off_t)size || ftruncate(fd, size) == 0))
+    {
+        ram = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        ram = ram == MAP_FAILED ? NULL : ram;
+    }
+    if (ram == NULL)
+    {
+        printf("Could not map %s, the game will not be saved\n", path);
+    }
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+    free(path);
+    return ram;
+}
+
+static enum cartridge_mbc _cartridge_mbc(BYTE type)
+{
+    switch (type)
+    {
+    case 0x00:
+    case 0x08:
+    case 0x09:
+        return CARTRIDGE_NO_MBC;
+    case 0x01:
+    case 0x02:
+    case 0x03:
+        return CARTRIDGE_MBC1;
+    case 0x0F:
+    case 0x10:
+    case 0x11:
+    case 0x12:
+    case 0x13:
+        return CARTRIDGE_MBC3;
+    case 0x19:
+    case 0x1A:
+    case 0x1B:
+    case 0x1C:
+    case 0x1D:
+    case 0x1E:
+        return CARTRIDGE_MBC5;
+    default:
+        printf("Unsupported cartridge type %02X, running it without banking\n", type);
+        return CARTRIDGE_NO_MBC;
+    }
+}
+
+static int _cartridge_ram_banks(BYTE ram_size)
+{
+    // 2KB carts still get a whole bank so the page table can map it
+    static const int banks[] = {0, 1, 1, 4, 16, 8};
+    if (ram_size >= sizeof(banks) / sizeof(banks[0]))
+    {
+        printf("Unknown cartridge RAM size %02X\n", ram_size);
+        return 0;
+    }
+    return banks[ram_size];
+}
+
+// Repoints the pages of whatever bank changed, switching is never a copy
+static void _cartridge_update_mapping()
+{
+    int low_bank = 0;
+    int high_bank = _cartridge.rom_bank;
+    int ram_bank = _cartridge.ram_bank;
+
+    if (_cartridge.mbc == CARTRIDGE_MBC1)
+    {
+        high_bank |= _cartridge.upper_bank << 5;
+        if (_cartridge.mode)
+        {
+            low_bank = _cartridge.upper_bank << 5;
+        }
+        ram_bank = _cartridge.mode ? _cartridge.upper_bank : 0;
+    }
+    low_bank %= _cartridge.rom_banks;
+    high_bank %= _cartridge.rom_banks;
+
+    // Code the cpu already decoded may be running from a page that changes, it has to look it up again
+    if (low_bank != _cartridge.low_bank)
+    {
+        _cartridge.low_bank = low_bank;
+        memory_map(0x0000, ROM_BANK_SIZE, &_cartridge.rom[low_bank * ROM_BANK_SIZE], NULL, NULL, _cartridge_write_rom);
+        cpu_end_run();
+    }
+    if (high_bank != _cartridge.high_bank)
+    {
+        _cartridge.high_bank = high_bank;
+        memory_map(0x4000, ROM_BANK_SIZE, &_cartridge.rom[high_bank * ROM_BANK_SIZE], NULL, NULL, _cartridge_write_rom);
+        cpu_end_run();
+    }
+
+    // MBC3 selects its clock registers through RAM banks 0x08 and up, on MBC5 those are ordinary RAM banks
+    BYTE *ram = NULL;
+    bool mbc3_register = _cartridge.mbc == CARTRIDGE_MBC3 && ram_bank >= 0x08;
+    bool rtc = _cartridge.ram_enabled && _cartridge.rtc && mbc3_register && ram_bank <= 0x0C;
+    if (_cartridge.ram_enabled && _cartridge.ram_banks > 0 && !mbc3_register)
+    {
+        ram = &_cartridge.ram[(ram_bank % _cartridge.ram_banks) * RAM_BANK_SIZE];
+    }
+    if (ram != _cartridge.ram_mapped || rtc != _cartridge.rtc_mapped)
+    {
+        _cartridge.ram_mapped = ram;
+        _cartridge.rtc_mapped = rtc;
+        memset(_cartridge.ram_writable, 0, sizeof(_cartridge.ram_writable));
+        if (rtc)
+        {
+            memory_map(0xA000, RAM_BANK_SIZE, NULL, NULL, _cartridge_read_rtc, _cartridge_write_rtc);
+        }
+        else if (ram != NULL && _cartridge.battery)
+        {
+            memory_map(0xA000, RAM_BANK_SIZE, ram, NULL, _cartridge_read_disabled, _cartridge_write_save);
+        }
+        else
+        {
+            memory_map(0xA000, RAM_BANK_SIZE, ram, ram, _cartridge_read_disabled, _cartridge_write_disabled);
+        }
+    }
+}
+
+// Games select banks by writing to ROM
+static void _cartridge_write_rom(WORD address, BYTE data)
+{
+    switch (_cartridge.mbc)
+    {
+    case CARTRIDGE_NO_MBC:
+        return;
+    case CARTRIDGE_MBC1:
+        if (address < 0x2000)
+            _cartridge.ram_enabled = (data & 0x0F) == 0x0A;
+        else if (address < 0x4000)
+            // Only the low 5 bits are checked for bank 0, so 0x20, 0x40 and 0x60 can not be mapped here
+            _cartridge.rom_bank = (data & 0x1F) == 0 ? 1 : data & 0x1F;
+        else if (address < 0x6000)
+            _cartridge.upper_bank = data & 0x03;
+        else
+            _cartridge.mode = data & 0x01;
+        break;
+    case CARTRIDGE_MBC3:
+        if (address < 0x2000)
+            _cartridge.ram_enabled = (data & 0x0F) == 0x0A;
+        else if (address < 0x4000)
+            _cartridge.rom_bank = (data & 0x7F) == 0 ? 1 : data & 0x7F;
+        else if (address < 0x6000)
+            _cartridge.ram_bank = data & 0x0F;
+        else if (_cartridge.rtc)
+            _cartridge_latch_rtc(data);
+        break;
+    case CARTRIDGE_MBC5:
+        if (address < 0x2000)
+            _cartridge.ram_enabled = (data & 0x0F) == 0x0A;
+        else if (address < 0x3000)
+            _cartridge.rom_bank = (_cartridge.rom_bank & 0x100) | data;
+        else if (address < 0x4000)
+            _cartridge.rom_bank = (_cartridge.rom_bank & 0xFF) | ((data & 0x01) << 8);
+        else if (address < 0x6000)
+            _cartridge.ram_bank = data & 0x0F;
+        break;
+    }
+    _cartridge_update_mapping();
+}
+
+bool cartridge_load(const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        printf("Could not open %s\n", path);
+        return false;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size < 2 * ROM_BANK_SIZE)
+    {
+        printf("%s is too small to be a ROM\n", path);
+        close(fd);
+        return false;
+    }
+
+    // Read the header first, so only the size it declares is mapped. A file shorter than that is a bad dump, its banks
+    // are wrapped like a smaller chip would be.
+    BYTE header[0x150];
+    if (pread(fd, header, sizeof(header), 0) != (ssize_t)sizeof(header))
+    {
+        printf("Could not read the header of %s\n", path);
+        close(fd);
+        return false;
+    }
+    int rom_banks = header[CARTRIDGE_ROM_SIZE_ADDRESS] <= 8 ? 2 << header[CARTRIDGE_ROM_SIZE_ADDRESS] : 0;
+    if (rom_banks == 0 || (off_t)rom_banks * ROM_BANK_SIZE > info.st_size)
+    {
+        printf("%s declares ROM size %02X but holds %lld bytes\n", path, header[CARTRIDGE_ROM_SIZE_ADDRESS],
+               (long long)info.st_size);
+        rom_banks = info.st_size / ROM_BANK_SIZE;
+    }
+
+    _cartridge.rom_size = (size_t)rom_banks * ROM_BANK_SIZE;
+    _cartridge.rom = mmap(NULL, _cartridge.rom_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (_cartridge.rom == MAP_FAILED)
+    {
+        printf("Could not map %s\n", path);
+        return false;
+    }
+    _cartridge.rom_banks = rom_banks;
+    _cartridge.mbc = _cartridge_mbc(header[CARTRIDGE_TYPE_ADDRESS]);
+
+    // ROM only carts have always been given plain RAM at 0xA000
+    _cartridge.ram_banks = _cartridge_ram_banks(header[CARTRIDGE_RAM_SIZE_ADDRESS]);
+    if (_cartridge.mbc == CARTRIDGE_NO_MBC && _cartridge.ram_banks == 0)
+    {
+        _cartridge.ram_banks = 1;
+    }
+    _cartridge.rtc = _cartridge_has_rtc(header[CARTRIDGE_TYPE_ADDRESS]);
+    _cartridge.ram_size = _cartridge.ram_banks * RAM_BANK_SIZE;
+    _cartridge.save_size = _cartridge.ram_size + (_cartridge.rtc ? CARTRIDGE_RTC_FOOTER_SIZE : 0);
+    _cartridge.battery = false;
+    if (_cartridge_has_battery(header[CARTRIDGE_TYPE_ADDRESS]) && _cartridge.save_size > 0)
+    {
+        _cartridge.ram = _cartridge_map_save(path, _cartridge.save_size);
+        _cartridge.battery = _cartridge.ram != NULL;
+    }
+    if (_cartridge.battery)
+    {
+        _cartridge.host_page_size = sysconf(_SC_PAGESIZE);
+        _cartridge.dirty = (bool *)calloc((_cartridge.save_size + _cartridge.host_page_size - 1) /
+                                              _cartridge.host_page_size, sizeof(bool));
+    }
+    else
+    {
+        _cartridge.ram = (BYTE *)calloc(_cartridge.ram_size + 1, sizeof(BYTE));
+    }
+    assert(_cartridge.ram);
+    _cartridge.ram_enabled = _cartridge.mbc == CARTRIDGE_NO_MBC;
+
+    _cartridge.rom_bank = 1;
+    _cartridge.upper_bank = 0;
+    _cartridge.ram_bank = 0;
+    _cartridge.mode = false;
+    if (_cartridge.rtc)
+    {
+        _cartridge_rtc_load();
+    }
+
+    // Forces both ROM banks to be mapped
+    _cartridge.low_bank = -1;
+    _cartridge.high_bank = -1;
+    _cartridge.ram_mapped = NULL;
+    _cartridge.rtc_mapped = false;
+    memory_map(0xA000, RAM_BANK_SIZE, NULL, NULL, _cartridge_read_disabled, _cartridge_write_disabled);
+    _cartridge_update_mapping();
+    return true;
+}
+
+void cartridge_flush_save(bool wait)
+{
+    if (!_cartridge.battery)
+    {
+        return;
+    }
+    for (size_t offset = 0; offset < _cartridge.save_size; offset += _cartridge.host_page_size)
+    {
+        bool *dirty = &_cartridge.dirty[offset / _cartridge.host_page_size];
+        if (!*dirty)
+        {
+            continue;
+        }
+        size_t length = _cartridge.save_size - offset;
+        length = length < _cartridge.host_page_size ? length : _cartridge.host_page_size;
+        msync(&_cartridge.ram[offset], length, wait ? MS_SYNC : MS_ASYNC);
+        *dirty = false;
+
+        // Catch the next write to the pages of the mapped bank this synced. A game writing all the time pays one
+        // handler call per page it writes and flush for that, the pages it leaves alone are still read only.
+        if (_cartridge.ram_mapped == NULL)
+        {
+            continue;
+        }
+        size_t bank = _cartridge.ram_mapped - _cartridge.ram;
+        if (offset >= bank + RAM_BANK_SIZE || offset + length <= bank)
+        {
+            continue;
+        }
+        size_t first = offset > bank ? offset - bank : 0;
+        size_t last = offset + length < bank + RAM_BANK_SIZE ? offset + length - bank : RAM_BANK_SIZE;
+        for (size_t page = first & ~(size_t)0xFF; page < last; page += 0x100)
+        {
+            if (_cartridge.ram_writable[page >> 8])
+            {
+                _cartridge.ram_writable[page >> 8] = false;
+                memory_map(0xA000 + page, 0x100, &_cartridge.ram_mapped[page], NULL, _cartridge_read_disabled,
+                           _cartridge_write_save);
+            }
+        }
+    }
+}
+
+void cartridge_close()
+{
+    munmap(_cartridge.rom, _cartridge.rom_size);
+    if (_cartridge.battery)
+    {
+        if (_cartridge.rtc)
+        {
+            _cartridge_rtc_save();
+        }
+        cartridge_flush_save(true);
+        munmap(_cartridge.ram, _cartridge.save_size);
+        free(_cartridge.dirty);
+    }
+    else
+    {
+        free(_cartridge.ram);
+    }
+    _cartridge.rom = NULL;
+    _cartridge.ram = NULL;
+}
+
+const BYTE *cartridge_rom()
+{
+    return _cartridge.rom;
+}
+
+int cartridge_rom_bank(WORD address)
+{
+    return address < 0x4000 ? _cartridge.low_bank : _cartridge.high_bank;
+}
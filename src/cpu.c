@@ -4,11 +4,181 @@
 #include <stdio.h>
 
 #include "cpu.h"
+#include "dynarec.h"
 #include "em_memory.h"
 #include "emulator.h"
 #include "common.h"
 
 static struct cpu_context _cpu;
+// Cycles cpu_run may still use before returning to the emulator, cleared by instructions that need the emulator to sync
+static int _cpu_run_budget;
+// Cycles the current run used before the instruction executing now, so what it schedules counts from when it happens
+static int _cpu_run_elapsed;
+
+// Lazy flags ////////////////////////////////////////////////////////
+// The 8-bit ALU helpers only record their operands, F is worked out from them the first time something reads it. Most
+// results are overwritten by the next ALU operation before a conditional jump, PUSH AF, DAA or ADC/SBC looks at them.
+// Anything touching F has to go through _cpu_flags or _cpu_set_flags rather than _cpu.AF.lo.
+enum cpu_flags_operation
+{
+    CPU_FLAGS_MATERIALIZED,
+    // ADD and ADC
+    CPU_FLAGS_ADD,
+    // SUB, SBC and CP
+    CPU_FLAGS_SUB,
+    CPU_FLAGS_AND,
+    // OR and XOR
+    CPU_FLAGS_OR,
+    CPU_FLAGS_INC,
+    CPU_FLAGS_DEC
+};
+
+struct cpu_lazy_flags
+{
+    BYTE operation;
+    // Operands, AND/OR/XOR keep their result in left
+    BYTE left;
+    BYTE right;
+    // Carry in for ADC/SBC, for INC/DEC the bits of F they leave alone
+    BYTE carry;
+};
+
+static struct cpu_lazy_flags _cpu_lazy_flags;
+
+#ifdef CPU_ALU_TABLES
+// Lookup tables, built once by cpu_intialize. About 14KB in all so they stay in cache.
+struct cpu_table_entry
+{
+    BYTE result;
+    BYTE flags;
+};
+
+// CB shifts and rotates in opcode order
+enum cpu_shift_operation
+{
+    CPU_SHIFT_RLC,
+    CPU_SHIFT_RRC,
+    CPU_SHIFT_RL,
+    CPU_SHIFT_RR,
+    CPU_SHIFT_SLA,
+    CPU_SHIFT_SRA,
+    CPU_SHIFT_SWAP,
+    CPU_SHIFT_SRL,
+    CPU_SHIFT_COUNT
+};
+
+// Z and C of a 9-bit sum or difference, H comes from bit 4 of left ^ right ^ result
+static BYTE _cpu_sum_flags[0x200];
+static BYTE _cpu_difference_flags[0x200];
+static BYTE _cpu_zero_flag[0x100];
+// Indexed by the value before INC/DEC, without the carry they keep
+static BYTE _cpu_inc_flags[0x100];
+static BYTE _cpu_dec_flags[0x100];
+// Indexed by operation, carry in and value
+static struct cpu_table_entry _cpu_shift_table[CPU_SHIFT_COUNT][2][0x100];
+// Indexed by A << 3 | N, H and C
+static struct cpu_table_entry _cpu_daa_table[0x100 << 3];
+
+static BYTE _cpu_materialize_flags()
+{
+    int left = _cpu_lazy_flags.left;
+    int right = _cpu_lazy_flags.right;
+    int carry = _cpu_lazy_flags.carry;
+    int result;
+
+    switch (_cpu_lazy_flags.operation)
+    {
+    case CPU_FLAGS_ADD:
+        result = left + right + carry;
+        return _cpu_sum_flags[result] | (((left ^ right ^ result) & 0x10) << 1);
+    case CPU_FLAGS_SUB:
+        result = (left - right - carry) & 0x1FF;
+        return _cpu_difference_flags[result] | (((left ^ right ^ result) & 0x10) << 1);
+    case CPU_FLAGS_AND:
+        return _cpu_zero_flag[left] | (0x01 << FLAG_H);
+    case CPU_FLAGS_OR:
+        return _cpu_zero_flag[left];
+    case CPU_FLAGS_INC:
+        return _cpu_inc_flags[left] | carry;
+    case CPU_FLAGS_DEC:
+        return _cpu_dec_flags[left] | carry;
+    default:
+        assert(false);
+        return 0;
+    }
+}
+#else
+static BYTE _cpu_materialize_flags()
+{
+    int left = _cpu_lazy_flags.left;
+    int right = _cpu_lazy_flags.right;
+    int carry = _cpu_lazy_flags.carry;
+    BYTE flags = 0;
+
+    switch (_cpu_lazy_flags.operation)
+    {
+    case CPU_FLAGS_ADD:
+        flags |= ((BYTE)(left + right + carry) == 0) << FLAG_Z;
+        flags |= ((left & 0x0F) + (right & 0x0F) + carry > 0x0F) << FLAG_H;
+        flags |= (left + right + carry > 0xFF) << FLAG_C;
+        break;
+    case CPU_FLAGS_SUB:
+        flags |= ((BYTE)(left - right - carry) == 0) << FLAG_Z;
+        flags |= 0x01 << FLAG_N;
+        flags |= ((left & 0x0F) < (right & 0x0F) + carry) << FLAG_H;
+        flags |= (left < right + carry) << FLAG_C;
+        break;
+    case CPU_FLAGS_AND:
+        flags |= (left == 0) << FLAG_Z;
+        flags |= 0x01 << FLAG_H;
+        break;
+    case CPU_FLAGS_OR:
+        flags |= (left == 0) << FLAG_Z;
+        break;
+    case CPU_FLAGS_INC:
+        flags = carry;
+        flags |= ((BYTE)(left + 1) == 0) << FLAG_Z;
+        flags |= ((left & 0x0F) == 0x0F) << FLAG_H;
+        break;
+    case CPU_FLAGS_DEC:
+        flags = carry;
+        flags |= ((BYTE)(left - 1) == 0) << FLAG_Z;
+        flags |= 0x01 << FLAG_N;
+        flags |= ((left & 0x0F) == 0) << FLAG_H;
+        break;
+    default:
+        assert(false);
+        break;
+    }
+    return flags;
+}
+#endif
+
+// F with any pending result worked out
+static BYTE *_cpu_flags()
+{
+    if (_cpu_lazy_flags.operation != CPU_FLAGS_MATERIALIZED)
+    {
+        _cpu.AF.lo = _cpu_materialize_flags();
+        _cpu_lazy_flags.operation = CPU_FLAGS_MATERIALIZED;
+    }
+    return &_cpu.AF.lo;
+}
+
+// Overwrite all of F, dropping any pending result
+static void _cpu_set_flags(BYTE flags)
+{
+    _cpu_lazy_flags.operation = CPU_FLAGS_MATERIALIZED;
+    _cpu.AF.lo = flags;
+}
+
+static void _cpu_defer_flags(BYTE operation, BYTE left, BYTE right, BYTE carry)
+{
+    _cpu_lazy_flags.operation = operation;
+    _cpu_lazy_flags.left = left;
+    _cpu_lazy_flags.right = right;
+    _cpu_lazy_flags.carry = carry;
+}
 
 // Helpers ////////////////////////////////////////////////////////////
 static WORD _read_word_at_pc();
@@ -38,6 +208,7 @@ static void _CPU_8BIT_SUB(BYTE *reg, BYTE to_sub);
 static void _CPU_8BIT_SUBC(BYTE *reg, BYTE to_sub);
 
 static void _CPU_16BIT_ADD(WORD *reg, WORD to_add);
+static WORD _CPU_SP_PLUS_SIGNED_BYTE(SIGNED_BYTE value);
 
 static void _CPU_16BIT_INC(WORD *reg);
 static void _CPU_8BIT_COMPARE(BYTE orig, BYTE comp);
@@ -64,10 +235,87 @@ static void _CPU_SWAP_NIBBLES(BYTE *reg);
 
 static int _cpu_execute_cb_instruction();
 
-void temp_print_registers()
+#ifdef CPU_ALU_TABLES
+// Fills the lookup tables by running the helpers they replace over every input, so both always agree
+static void _cpu_build_tables()
 {
-    // printf("AF:%0X\tBC:%0X\tDE:%0X\tHL:%0X \t SP:%0X  [0XFF44] = %X\n", _cpu.AF.reg, _cpu.BC.reg, _cpu.DE.reg, _cpu.HL.reg, _cpu.SP.reg, memory_read(0XFF44));
+    static void (*const shifts[CPU_SHIFT_COUNT])(BYTE *) = {
+        _CPU_RL_INTO_CARRY, _CPU_RR_INTO_CARRY, _CPU_RL_THROUGH_CARRY, _CPU_RR_THROUGH_CARRY,
+        _CPU_SHIFT_LEFT_INTO_CARRY, _CPU_SHIFT_RIGHT_INTO_CARRY_PROPOGATE, _CPU_SWAP_NIBBLES, _CPU_SHIFT_RIGHT_INTO_CARRY};
+    struct cpu_context saved = _cpu;
+
+    for (int value = 0; value < 0x200; value++)
+    {
+        BYTE flags = (value & 0xFF) == 0 ? 0x01 << FLAG_Z : 0;
+        if (value & 0x100)
+        {
+            flags |= 0x01 << FLAG_C;
+        }
+        _cpu_sum_flags[value] = flags;
+        _cpu_difference_flags[value] = flags | (0x01 << FLAG_N);
+    }
+
+    // Filled by hand, the helpers defer to these tables themselves
+    for (int value = 0; value < 0x100; value++)
+    {
+        _cpu_zero_flag[value] = value == 0 ? 0x01 << FLAG_Z : 0;
+        _cpu_inc_flags[value] = _cpu_zero_flag[(value + 1) & 0xFF] | (((value & 0x0F) == 0x0F) << FLAG_H);
+        _cpu_dec_flags[value] = _cpu_zero_flag[(value - 1) & 0xFF] | (0x01 << FLAG_N) | (((value & 0x0F) == 0) << FLAG_H);
+    }
+
+    for (int value = 0; value < 0x100; value++)
+    {
+        BYTE reg;
+
+        for (int operation = 0; operation < CPU_SHIFT_COUNT; operation++)
+        {
+            for (int carry = 0; carry < 2; carry++)
+            {
+                reg = value;
+                _cpu_set_flags(carry << FLAG_C);
+                shifts[operation](&reg);
+                _cpu_shift_table[operation][carry][value].result = reg;
+                _cpu_shift_table[operation][carry][value].flags = *_cpu_flags();
+            }
+        }
+    }
+
+    for (int index = 0; index < (0x100 << 3); index++)
+    {
+        _cpu.AF.hi = index >> 3;
+        _cpu_set_flags((index & 0x07) << FLAG_C);
+        _CPU_DAA();
+        _cpu_daa_table[index].result = _cpu.AF.hi;
+        _cpu_daa_table[index].flags = *_cpu_flags();
+    }
+
+    _cpu = saved;
+    _cpu_set_flags(saved.AF.lo);
 }
+#endif
+
+// Table-driven core, see cpu_next_execute_instruction
+typedef int (*cpu_opcode_handler)(WORD operand);
+typedef void (*cpu_cb_handler)();
+
+struct cpu_opcode
+{
+    cpu_opcode_handler handler;
+    // Cycles when no branch is taken
+    BYTE cycles;
+    // Length in bytes including the opcode
+    BYTE length;
+};
+
+struct cpu_cb_opcode
+{
+    cpu_cb_handler handler;
+    BYTE cycles;
+};
+
+static const struct cpu_opcode _cpu_opcodes[256];
+static const struct cpu_cb_opcode _cpu_cb_opcodes[256];
+
 void cpu_interrupt(WORD interrupt_address)
 {
     _push_word_onto_stack(_cpu.PC.reg);
@@ -76,16 +324,55 @@ void cpu_interrupt(WORD interrupt_address)
 
 void cpu_intialize()
 {
+#ifdef CPU_ALU_TABLES
+    _cpu_build_tables();
+#endif
     memset(&_cpu, 0, sizeof(_cpu));
-    // _cpu.PC.reg = 0x100;
-    // _cpu.AF.reg = 0x01B0;
-    // _cpu.BC.reg = 0x0013;
-    // _cpu.DE.reg = 0x00D8;
-    // _cpu.HL.reg = 0x014D;
-    // _cpu.SP.reg = 0xFFFE;
+    _cpu_set_flags(0);
+#ifdef CPU_DYNAREC
+    dynarec_init();
+#endif
+    cpu_flush_code_cache();
+}
+
+// Registers as the DMG boot rom leaves them
+void cpu_skip_boot()
+{
+    _cpu.PC.reg = 0x100;
+    _cpu.AF.hi = 0x01;
+    _cpu_set_flags(0xB0);
+    _cpu.BC.reg = 0x0013;
+    _cpu.DE.reg = 0x00D8;
+    _cpu.HL.reg = 0x014D;
+    _cpu.SP.reg = 0xFFFE;
 }
 
+// Decode an opcode through the opcode table. The immediate operand is fetched here, so handlers never touch PC unless they branch.
 int cpu_next_execute_instruction()
+{
+#ifdef CPU_REFERENCE_CORE
+    return cpu_reference_execute_instruction();
+#endif
+    BYTE opcode = memory_read(_cpu.PC.reg);
+    const struct cpu_opcode *op = &_cpu_opcodes[opcode];
+
+    WORD operand = 0;
+    if (op->length == 2)
+    {
+        operand = memory_read(_cpu.PC.reg + 1);
+    }
+    else if (op->length == 3)
+    {
+        operand = memory_read(_cpu.PC.reg + 2) << 8;
+        operand |= memory_read(_cpu.PC.reg + 1);
+    }
+    _cpu.PC.reg += op->length;
+
+    return op->cycles + op->handler(operand);
+}
+
+// Original switch based interpreter, kept as a reference to compare the table-driven core against
+int cpu_reference_execute_instruction()
 {
     // Read next opcode and increment PC
     BYTE opcode = memory_read(_cpu.PC.reg);
@@ -1122,22 +1409,22 @@ int cpu_next_execute_instruction()
     }
     case 0xC2:
     {
-        _CPU_JUMP_TO_IMMEDIATE_WORD(bit_test(_cpu.AF.lo, FLAG_Z), false);
+        _CPU_JUMP_TO_IMMEDIATE_WORD(bit_test(*_cpu_flags(), FLAG_Z), false);
         return 12;
     }
     case 0xCA:
     {
-        _CPU_JUMP_TO_IMMEDIATE_WORD(bit_test(_cpu.AF.lo, FLAG_Z), true);
+        _CPU_JUMP_TO_IMMEDIATE_WORD(bit_test(*_cpu_flags(), FLAG_Z), true);
         return 12;
     }
     case 0xD2:
     {
-        _CPU_JUMP_TO_IMMEDIATE_WORD(bit_test(_cpu.AF.lo, FLAG_C), false);
+        _CPU_JUMP_TO_IMMEDIATE_WORD(bit_test(*_cpu_flags(), FLAG_C), false);
         return 12;
     }
     case 0xDA:
     {
-        _CPU_JUMP_TO_IMMEDIATE_WORD(bit_test(_cpu.AF.lo, FLAG_C), true);
+        _CPU_JUMP_TO_IMMEDIATE_WORD(bit_test(*_cpu_flags(), FLAG_C), true);
         return 12;
     }
 
@@ -1148,19 +1435,19 @@ int cpu_next_execute_instruction()
     }
     case 0x20: // JR NZ,*
     {
-        return _CPU_JUMP_IF_CONDITION(bit_test(_cpu.AF.lo, FLAG_Z), false);
+        return _CPU_JUMP_IF_CONDITION(bit_test(*_cpu_flags(), FLAG_Z), false);
     }
     case 0x28: // JR Z,*
     {
-        return _CPU_JUMP_IF_CONDITION(bit_test(_cpu.AF.lo, FLAG_Z), true);
+        return _CPU_JUMP_IF_CONDITION(bit_test(*_cpu_flags(), FLAG_Z), true);
     }
     case 0x30: // JR NC,*
     {
-        return _CPU_JUMP_IF_CONDITION(bit_test(_cpu.AF.lo, FLAG_C), false);
+        return _CPU_JUMP_IF_CONDITION(bit_test(*_cpu_flags(), FLAG_C), false);
     }
     case 0x38: // JR C,*
     {
-        return _CPU_JUMP_IF_CONDITION(bit_test(_cpu.AF.lo, FLAG_C), true);
+        return _CPU_JUMP_IF_CONDITION(bit_test(*_cpu_flags(), FLAG_C), true);
     }
 
     // calls
@@ -1170,19 +1457,19 @@ int cpu_next_execute_instruction()
     }
     case 0xC4:
     {
-        return _CPU_CALL(bit_test(_cpu.AF.lo, FLAG_Z), false);
+        return _CPU_CALL(bit_test(*_cpu_flags(), FLAG_Z), false);
     }
     case 0xCC:
     {
-        return _CPU_CALL(bit_test(_cpu.AF.lo, FLAG_Z), true);
+        return _CPU_CALL(bit_test(*_cpu_flags(), FLAG_Z), true);
     }
     case 0xD4:
     {
-        return _CPU_CALL(bit_test(_cpu.AF.lo, FLAG_C), false);
+        return _CPU_CALL(bit_test(*_cpu_flags(), FLAG_C), false);
     }
     case 0xDC:
     {
-        return _CPU_CALL(bit_test(_cpu.AF.lo, FLAG_C), true);
+        return _CPU_CALL(bit_test(*_cpu_flags(), FLAG_C), true);
     }
 
     // returns
@@ -1193,29 +1480,29 @@ int cpu_next_execute_instruction()
     }
     case 0xC0:
     {
-        _CPU_RETURN(bit_test(_cpu.AF.lo, FLAG_Z), false);
-        return bit_test(_cpu.AF.lo, FLAG_Z) == false ? 20 : 8;
+        _CPU_RETURN(bit_test(*_cpu_flags(), FLAG_Z), false);
+        return bit_test(*_cpu_flags(), FLAG_Z) == false ? 20 : 8;
     }
     case 0xC8:
     {
-        _CPU_RETURN(bit_test(_cpu.AF.lo, FLAG_Z), true);
-        return bit_test(_cpu.AF.lo, FLAG_Z) == true ? 20 : 8;
+        _CPU_RETURN(bit_test(*_cpu_flags(), FLAG_Z), true);
+        return bit_test(*_cpu_flags(), FLAG_Z) == true ? 20 : 8;
     }
     case 0xD0:
     {
-        _CPU_RETURN(bit_test(_cpu.AF.lo, FLAG_C), false);
-        return bit_test(_cpu.AF.lo, FLAG_C) == false ? 20 : 8;
+        _CPU_RETURN(bit_test(*_cpu_flags(), FLAG_C), false);
+        return bit_test(*_cpu_flags(), FLAG_C) == false ? 20 : 8;
     }
     case 0xD8:
     {
-        _CPU_RETURN(bit_test(_cpu.AF.lo, FLAG_C), true);
-        return bit_test(_cpu.AF.lo, FLAG_C) == true ? 20 : 8;
+        _CPU_RETURN(bit_test(*_cpu_flags(), FLAG_C), true);
+        return bit_test(*_cpu_flags(), FLAG_C) == true ? 20 : 8;
     }
 
     // push word onto stack
     case 0xF5:
     {
-        _push_word_onto_stack(_cpu.AF.reg);
+        _push_word_onto_stack((_cpu.AF.hi << 8) | *_cpu_flags());
         return 16;
     }
     case 0xC5:
@@ -1237,10 +1524,12 @@ int cpu_next_execute_instruction()
     // Pop word off stack and put into register
     case 0xF1:
     {
-        _cpu.AF.reg = _pop_word_off_stack();
+        WORD af = _pop_word_off_stack();
         // Need to mask since the lower four bits of AF are hardwired to zero.
         // Took me hours to find the bug :(
-        _cpu.AF.reg &= 0xfff0;
+        af &= 0xfff0;
+        _cpu.AF.hi = af >> 8;
+        _cpu_set_flags(af & 0xFF);
         return 12;
     }
     case 0xC1:
@@ -1306,14 +1595,14 @@ int cpu_next_execute_instruction()
     {
         _CPU_RL_INTO_CARRY(&_cpu.AF.hi);
         // Have to reset zero bit, otherwise fails Blarggs 09
-        bit_reset(&_cpu.AF.lo, FLAG_Z);
+        bit_reset(_cpu_flags(), FLAG_Z);
         return 4;
     }
     case 0x0F:
     {
         _CPU_RR_INTO_CARRY(&_cpu.AF.hi);
         // Have to reset zero bit, otherwise fails Blarggs 09
-        bit_reset(&_cpu.AF.lo, FLAG_Z);
+        bit_reset(_cpu_flags(), FLAG_Z);
         return 4;
     }
     case 0x08:
@@ -1328,23 +1617,23 @@ int cpu_next_execute_instruction()
     case 0x2F:
     {
         _cpu.AF.hi ^= 0xFF;
-        bit_set(&_cpu.AF.lo, FLAG_N);
-        bit_set(&_cpu.AF.lo, FLAG_H);
+        bit_set(_cpu_flags(), FLAG_N);
+        bit_set(_cpu_flags(), FLAG_H);
         return 4;
     }
     case 0x3F:
     {
-        if (bit_test(_cpu.AF.lo, FLAG_C))
+        if (bit_test(*_cpu_flags(), FLAG_C))
         {
-            bit_reset(&_cpu.AF.lo, FLAG_C);
+            bit_reset(_cpu_flags(), FLAG_C);
         }
         else
         {
-            bit_set(&_cpu.AF.lo, FLAG_C);
+            bit_set(_cpu_flags(), FLAG_C);
         }
 
-        bit_reset(&_cpu.AF.lo, FLAG_N);
-        bit_reset(&_cpu.AF.lo, FLAG_H);
+        bit_reset(_cpu_flags(), FLAG_N);
+        bit_reset(_cpu_flags(), FLAG_H);
         return 4;
     }
     case 0xD9:
@@ -1362,14 +1651,14 @@ int cpu_next_execute_instruction()
     {
         _CPU_RL_THROUGH_CARRY(&_cpu.AF.hi);
         // Have to reset zero bit, otherwise fails Blarggs 09
-        bit_reset(&_cpu.AF.lo, FLAG_Z);
+        bit_reset(_cpu_flags(), FLAG_Z);
         return 4;
     }
     case 0x1F: // RRA through carry
     {
         _CPU_RR_THROUGH_CARRY(&_cpu.AF.hi);
         // Have to reset zero bit, otherwise fails Blarggs 09
-        bit_reset(&_cpu.AF.lo, FLAG_Z);
+        bit_reset(_cpu_flags(), FLAG_Z);
         return 4;
     }
     case 0x36: // LD (HL),n
@@ -1381,9 +1670,9 @@ int cpu_next_execute_instruction()
     }
     case 0x37: // Set carry flag
     {
-        bit_reset(&_cpu.AF.lo, FLAG_N);
-        bit_reset(&_cpu.AF.lo, FLAG_H);
-        bit_set(&_cpu.AF.lo, FLAG_C);
+        bit_reset(_cpu_flags(), FLAG_N);
+        bit_reset(_cpu_flags(), FLAG_H);
+        bit_set(_cpu_flags(), FLAG_C);
         return 4;
     }
     case 0xF3: // Disable interupts
@@ -1398,11 +1687,11 @@ int cpu_next_execute_instruction()
         _cpu.PC.reg += 1;
 
         int result = (int)(reg + value);
-        _cpu.AF.lo = 0;
+        _cpu_set_flags(0);
         if (((reg ^ value ^ (result & 0xFFFF)) & 0x10) == 0x10)
-            bit_set(&_cpu.AF.lo, FLAG_H);
+            bit_set(_cpu_flags(), FLAG_H);
         if (((reg ^ value ^ (result & 0xFFFF)) & 0x100) == 0x100)
-            bit_set(&_cpu.AF.lo, FLAG_C);
+            bit_set(_cpu_flags(), FLAG_C);
 
         _cpu.SP.reg = (WORD)result;
 
@@ -1433,11 +1722,11 @@ int cpu_next_execute_instruction()
         _cpu.PC.reg += 1;
 
         int result = (int)(reg + value);
-        _cpu.AF.lo = 0;
+        _cpu_set_flags(0);
         if (((reg ^ value ^ (result & 0xFFFF)) & 0x10) == 0x10)
-            bit_set(&_cpu.AF.lo, FLAG_H);
+            bit_set(_cpu_flags(), FLAG_H);
         if (((reg ^ value ^ (result & 0xFFFF)) & 0x100) == 0x100)
-            bit_set(&_cpu.AF.lo, FLAG_C);
+            bit_set(_cpu_flags(), FLAG_C);
 
         _cpu.HL.reg = (WORD)result;
 
@@ -2823,327 +3112,1664 @@ static int _cpu_execute_cb_instruction()
     }
 }
 
-static void _CPU_DAA()
+// Table-driven core //////////////////////////////////////////////////
+// Handlers for every opcode, generated per instruction family so each one is a small function the compiler can inline
+// into the dispatcher. The operand has already been fetched and PC points at the next instruction when a handler runs.
+// The value returned is the number of cycles on top of the base cycles in the table, only taken branches return non zero.
+
+#ifdef CPU_ALU_TABLES
+#define _CPU_DEFINE_TABLE_SHIFT(name, operation, CARRY)                                          \
+    static void _cpu_table_##name(BYTE *reg)                                                    \
+    {                                                                                           \
+        const struct cpu_table_entry *entry = &_cpu_shift_table[operation][CARRY][*reg];        \
+        *reg = entry->result;                                                                   \
+        _cpu_set_flags(entry->flags);                                                           \
+    }
+
+// Only RL and RR read the carry, the rest skip working out pending flags
+_CPU_DEFINE_TABLE_SHIFT(rlc, CPU_SHIFT_RLC, 0)
+_CPU_DEFINE_TABLE_SHIFT(rrc, CPU_SHIFT_RRC, 0)
+_CPU_DEFINE_TABLE_SHIFT(rl, CPU_SHIFT_RL, bit_get(*_cpu_flags(), FLAG_C))
+_CPU_DEFINE_TABLE_SHIFT(rr, CPU_SHIFT_RR, bit_get(*_cpu_flags(), FLAG_C))
+_CPU_DEFINE_TABLE_SHIFT(sla, CPU_SHIFT_SLA, 0)
+_CPU_DEFINE_TABLE_SHIFT(sra, CPU_SHIFT_SRA, 0)
+_CPU_DEFINE_TABLE_SHIFT(swap, CPU_SHIFT_SWAP, 0)
+_CPU_DEFINE_TABLE_SHIFT(srl, CPU_SHIFT_SRL, 0)
+
+static void _cpu_table_daa()
 {
-    WORD s = _cpu.AF.hi;
-
-    if (bit_test(_cpu.AF.lo, FLAG_N))
-    {
-        if (bit_test(_cpu.AF.lo, FLAG_H))
-            s = (s - 0x06) & 0xFF;
-        if (bit_test(_cpu.AF.lo, FLAG_C))
-            s -= 0x60;
-    }
-    else
-    {
-        if (bit_test(_cpu.AF.lo, FLAG_H) || (s & 0xF) > 9)
-            s += 0x06;
-        if (bit_test(_cpu.AF.lo, FLAG_C) || s > 0x9F)
-            s += 0x60;
-    }
-
-    _cpu.AF.hi = s;
-    bit_reset(&_cpu.AF.lo, FLAG_H);
-
-    if (_cpu.AF.hi)
-        bit_reset(&_cpu.AF.lo, FLAG_Z);
-    else
-        bit_set(&_cpu.AF.lo, FLAG_Z);
-
-    if (s >= 0x100)
-        bit_set(&_cpu.AF.lo, FLAG_C);
+    BYTE flags = *_cpu_flags();
+    const struct cpu_table_entry *entry = &_cpu_daa_table[(_cpu.AF.hi << 3) | ((flags >> FLAG_C) & 0x07)];
+    _cpu.AF.hi = entry->result;
+    _cpu_set_flags(entry->flags | (flags & 0x0F));
 }
-// Take BYTE at PC and set register to it
-static void _CPU_8BIT_LOAD(BYTE *reg)
+
+#define _CPU_CORE_RLC _cpu_table_rlc
+#define _CPU_CORE_RRC _cpu_table_rrc
+#define _CPU_CORE_RL _cpu_table_rl
+#define _CPU_CORE_RR _cpu_table_rr
+#define _CPU_CORE_SLA _cpu_table_sla
+#define _CPU_CORE_SRA _cpu_table_sra
+#define _CPU_CORE_SWAP _cpu_table_swap
+#define _CPU_CORE_SRL _cpu_table_srl
+#define _CPU_CORE_DAA _cpu_table_daa
+#else
+#define _CPU_CORE_RLC _CPU_RL_INTO_CARRY
+#define _CPU_CORE_RRC _CPU_RR_INTO_CARRY
+#define _CPU_CORE_RL _CPU_RL_THROUGH_CARRY
+#define _CPU_CORE_RR _CPU_RR_THROUGH_CARRY
+#define _CPU_CORE_SLA _CPU_SHIFT_LEFT_INTO_CARRY
+#define _CPU_CORE_SRA _CPU_SHIFT_RIGHT_INTO_CARRY_PROPOGATE
+#define _CPU_CORE_SWAP _CPU_SWAP_NIBBLES
+#define _CPU_CORE_SRL _CPU_SHIFT_RIGHT_INTO_CARRY
+#define _CPU_CORE_DAA _CPU_DAA
+#endif
+
+// Opcode encodes 8-bit register operands in the order B, C, D, E, H, L, (HL), A
+#define _CPU_DEFINE_LD_R8(name, dst)                                                                                        \
+    static int _cpu_op_ld_##name##_b(WORD operand) { (void)operand; _CPU_REG_LOAD(&dst, _cpu.BC.hi); return 0; }             \
+    static int _cpu_op_ld_##name##_c(WORD operand) { (void)operand; _CPU_REG_LOAD(&dst, _cpu.BC.lo); return 0; }             \
+    static int _cpu_op_ld_##name##_d(WORD operand) { (void)operand; _CPU_REG_LOAD(&dst, _cpu.DE.hi); return 0; }             \
+    static int _cpu_op_ld_##name##_e(WORD operand) { (void)operand; _CPU_REG_LOAD(&dst, _cpu.DE.lo); return 0; }             \
+    static int _cpu_op_ld_##name##_h(WORD operand) { (void)operand; _CPU_REG_LOAD(&dst, _cpu.HL.hi); return 0; }             \
+    static int _cpu_op_ld_##name##_l(WORD operand) { (void)operand; _CPU_REG_LOAD(&dst, _cpu.HL.lo); return 0; }             \
+    static int _cpu_op_ld_##name##_hl(WORD operand) { (void)operand; _CPU_REG_LOAD_FROM_MEMORY(&dst, _cpu.HL.reg); return 0; } \
+    static int _cpu_op_ld_##name##_a(WORD operand) { (void)operand; _CPU_REG_LOAD(&dst, _cpu.AF.hi); return 0; }             \
+    static int _cpu_op_ld_##name##_n(WORD operand) { _CPU_REG_LOAD(&dst, (BYTE)operand); return 0; }                        \
+    static int _cpu_op_inc_##name(WORD operand) { (void)operand; _CPU_8BIT_INC(&dst); return 0; }                           \
+    static int _cpu_op_dec_##name(WORD operand) { (void)operand; _CPU_8BIT_DEC(&dst); return 0; }
+
+_CPU_DEFINE_LD_R8(b, _cpu.BC.hi)
+_CPU_DEFINE_LD_R8(c, _cpu.BC.lo)
+_CPU_DEFINE_LD_R8(d, _cpu.DE.hi)
+_CPU_DEFINE_LD_R8(e, _cpu.DE.lo)
+_CPU_DEFINE_LD_R8(h, _cpu.HL.hi)
+_CPU_DEFINE_LD_R8(l, _cpu.HL.lo)
+_CPU_DEFINE_LD_R8(a, _cpu.AF.hi)
+
+// LD (HL),r
+#define _CPU_DEFINE_LD_HL_R8(name, src) \
+    static int _cpu_op_ld_hl_##name(WORD operand) { (void)operand; memory_write(_cpu.HL.reg, src); return 0; }
+
+_CPU_DEFINE_LD_HL_R8(b, _cpu.BC.hi)
+_CPU_DEFINE_LD_HL_R8(c, _cpu.BC.lo)
+_CPU_DEFINE_LD_HL_R8(d, _cpu.DE.hi)
+_CPU_DEFINE_LD_HL_R8(e, _cpu.DE.lo)
+_CPU_DEFINE_LD_HL_R8(h, _cpu.HL.hi)
+_CPU_DEFINE_LD_HL_R8(l, _cpu.HL.lo)
+_CPU_DEFINE_LD_HL_R8(a, _cpu.AF.hi)
+_CPU_DEFINE_LD_HL_R8(n, (BYTE)operand)
+
+// ALU operations on A, OP is a macro that takes the value to operate with
+#define _CPU_ALU_ADD(value) _CPU_8BIT_ADD(&_cpu.AF.hi, value)
+#define _CPU_ALU_ADC(value) _CPU_8BIT_ADC(&_cpu.AF.hi, value)
+#define _CPU_ALU_SUB(value) _CPU_8BIT_SUB(&_cpu.AF.hi, value)
+#define _CPU_ALU_SBC(value) _CPU_8BIT_SUBC(&_cpu.AF.hi, value)
+#define _CPU_ALU_AND(value) _CPU_8BIT_AND(&_cpu.AF.hi, value)
+#define _CPU_ALU_XOR(value) _CPU_8BIT_XOR(&_cpu.AF.hi, value, false)
+#define _CPU_ALU_OR(value) _CPU_8BIT_OR(&_cpu.AF.hi, value)
+#define _CPU_ALU_CP(value) _CPU_8BIT_COMPARE(_cpu.AF.hi, value)
+
+#define _CPU_DEFINE_ALU(name, OP)                                                                         \
+    static int _cpu_op_##name##_b(WORD operand) { (void)operand; OP(_cpu.BC.hi); return 0; }               \
+    static int _cpu_op_##name##_c(WORD operand) { (void)operand; OP(_cpu.BC.lo); return 0; }               \
+    static int _cpu_op_##name##_d(WORD operand) { (void)operand; OP(_cpu.DE.hi); return 0; }               \
+    static int _cpu_op_##name##_e(WORD operand) { (void)operand; OP(_cpu.DE.lo); return 0; }               \
+    static int _cpu_op_##name##_h(WORD operand) { (void)operand; OP(_cpu.HL.hi); return 0; }               \
+    static int _cpu_op_##name##_l(WORD operand) { (void)operand; OP(_cpu.HL.lo); return 0; }               \
+    static int _cpu_op_##name##_hl(WORD operand) { (void)operand; OP(memory_read(_cpu.HL.reg)); return 0; } \
+    static int _cpu_op_##name##_a(WORD operand) { (void)operand; OP(_cpu.AF.hi); return 0; }               \
+    static int _cpu_op_##name##_n(WORD operand) { OP((BYTE)operand); return 0; }
+
+_CPU_DEFINE_ALU(add, _CPU_ALU_ADD)
+_CPU_DEFINE_ALU(adc, _CPU_ALU_ADC)
+_CPU_DEFINE_ALU(sub, _CPU_ALU_SUB)
+_CPU_DEFINE_ALU(sbc, _CPU_ALU_SBC)
+_CPU_DEFINE_ALU(and, _CPU_ALU_AND)
+_CPU_DEFINE_ALU(xor, _CPU_ALU_XOR)
+_CPU_DEFINE_ALU(or, _CPU_ALU_OR)
+_CPU_DEFINE_ALU(cp, _CPU_ALU_CP)
+
+// 16-bit register operands in opcode order: BC, DE, HL, SP
+#define _CPU_DEFINE_R16(name, r16)                                                                         \
+    static int _cpu_op_ld_##name##_nn(WORD operand) { r16 = operand; return 0; }                            \
+    static int _cpu_op_inc_##name(WORD operand) { (void)operand; _CPU_16BIT_INC(&r16); return 0; }          \
+    static int _cpu_op_dec_##name(WORD operand) { (void)operand; _CPU_16BIT_DEC(&r16); return 0; }          \
+    static int _cpu_op_add_hl_##name(WORD operand) { (void)operand; _CPU_16BIT_ADD(&_cpu.HL.reg, r16); return 0; }
+
+_CPU_DEFINE_R16(bc, _cpu.BC.reg)
+_CPU_DEFINE_R16(de, _cpu.DE.reg)
+_CPU_DEFINE_R16(hl, _cpu.HL.reg)
+_CPU_DEFINE_R16(sp, _cpu.SP.reg)
+
+// PUSH/POP, AF is handled separately since the low nibble of F is hardwired to zero
+#define _CPU_DEFINE_STACK(name, r16)                                                                  \
+    static int _cpu_op_push_##name(WORD operand) { (void)operand; _push_word_onto_stack(r16); return 0; } \
+    static int _cpu_op_pop_##name(WORD operand) { (void)operand; r16 = _pop_word_off_stack(); return 0; }
+
+_CPU_DEFINE_STACK(bc, _cpu.BC.reg)
+_CPU_DEFINE_STACK(de, _cpu.DE.reg)
+_CPU_DEFINE_STACK(hl, _cpu.HL.reg)
+
+static int _cpu_op_push_af(WORD operand)
 {
-    BYTE value = _read_byte_at_pc();
-    *reg = value;
-    _cpu.PC.reg += 1;
+    (void)operand;
+    _push_word_onto_stack((_cpu.AF.hi << 8) | *_cpu_flags());
+    return 0;
 }
 
-// Take WORD at PC and set register to it
-static void _CPU_16BIT_LOAD(WORD *reg)
+static int _cpu_op_pop_af(WORD operand)
 {
-    WORD value = _read_word_at_pc();
-    *reg = value;
-    _cpu.PC.reg += 2;
+    (void)operand;
+    // Need to mask since the lower four bits of AF are hardwired to zero.
+    WORD af = _pop_word_off_stack() & 0xfff0;
+    _cpu.AF.hi = af >> 8;
+    _cpu_set_flags(af & 0xFF);
+    return 0;
 }
 
-// Load BYTE value to the register
-static void _CPU_REG_LOAD(BYTE *reg, BYTE val)
+// Branches, condition is evaluated when the handler runs
+#define _CPU_COND_ALWAYS true
+#define _CPU_COND_NZ !bit_test(*_cpu_flags(), FLAG_Z)
+#define _CPU_COND_Z bit_test(*_cpu_flags(), FLAG_Z)
+#define _CPU_COND_NC !bit_test(*_cpu_flags(), FLAG_C)
+#define _CPU_COND_C bit_test(*_cpu_flags(), FLAG_C)
+
+#define _CPU_DEFINE_BRANCHES(name, COND)                        \
+    static int _cpu_op_jr_##name(WORD operand)                  \
+    {                                                           \
+        if (!(COND))                                            \
+            return 0;                                           \
+        _cpu.PC.reg += (SIGNED_BYTE)operand;                    \
+        return 4;                                               \
+    }                                                           \
+    static int _cpu_op_jp_##name(WORD operand)                  \
+    {                                                           \
+        if (COND)                                               \
+            _cpu.PC.reg = operand;                              \
+        return 0;                                               \
+    }                                                           \
+    static int _cpu_op_call_##name(WORD operand)                \
+    {                                                           \
+        if (!(COND))                                            \
+            return 0;                                           \
+        _push_word_onto_stack(_cpu.PC.reg);                     \
+        _cpu.PC.reg = operand;                                  \
+        return 12;                                              \
+    }                                                           \
+    static int _cpu_op_ret_##name(WORD operand)                 \
+    {                                                           \
+        (void)operand;                                          \
+        if (!(COND))                                            \
+            return 0;                                           \
+        _cpu.PC.reg = _pop_word_off_stack();                    \
+        return 12;                                              \
+    }
+
+_CPU_DEFINE_BRANCHES(always, _CPU_COND_ALWAYS)
+_CPU_DEFINE_BRANCHES(nz, _CPU_COND_NZ)
+_CPU_DEFINE_BRANCHES(z, _CPU_COND_Z)
+_CPU_DEFINE_BRANCHES(nc, _CPU_COND_NC)
+_CPU_DEFINE_BRANCHES(c, _CPU_COND_C)
+
+#define _CPU_DEFINE_RST(address) \
+    static int _cpu_op_rst_##address(WORD operand) { (void)operand; _CPU_RESTART(address); return 0; }
+
+_CPU_DEFINE_RST(0x00)
+_CPU_DEFINE_RST(0x08)
+_CPU_DEFINE_RST(0x10)
+_CPU_DEFINE_RST(0x18)
+_CPU_DEFINE_RST(0x20)
+_CPU_DEFINE_RST(0x28)
+_CPU_DEFINE_RST(0x30)
+_CPU_DEFINE_RST(0x38)
+
+// Remaining one off instructions
+static int _cpu_op_nop(WORD operand)
 {
-    *reg = val;
+    (void)operand;
+    return 0;
 }
 
-// Load a BYTE from memory into a register
-static void _CPU_REG_LOAD_FROM_MEMORY(BYTE *reg, WORD address)
+static int _cpu_op_illegal(WORD operand)
 {
-    *reg = memory_read(address);
+    (void)operand;
+    printf("Not implemented %x at PC%x\n", memory_read(_cpu.PC.reg - 1), _cpu.PC.reg - 1);
+    assert(false);
+    return 0;
 }
 
-static void _CPU_8BIT_XOR(BYTE *reg, BYTE to_xor, bool read_byte)
+static int _cpu_op_ld_bc_a(WORD operand)
 {
-    // Only for instruction 0xEE
-    if (read_byte)
-    {
-        to_xor = _read_byte_at_pc();
-        _cpu.PC.reg += 1;
-    }
-
-    *reg ^= to_xor;
-
-    _cpu.AF.lo = 0x00;
-    if (*reg == 0)
-    {
-        bit_set(&_cpu.AF.lo, FLAG_Z);
-    }
+    (void)operand;
+    memory_write(_cpu.BC.reg, _cpu.AF.hi);
+    return 0;
 }
 
-// OR register with value, set flags
-static void _CPU_8BIT_OR(BYTE *reg, BYTE to_or)
+static int _cpu_op_ld_de_a(WORD operand)
 {
-    *reg |= to_or;
-    _cpu.AF.lo = 0;
-
-    if (*reg == 0)
-    {
-        bit_set(&_cpu.AF.lo, FLAG_Z);
-    }
+    (void)operand;
+    memory_write(_cpu.DE.reg, _cpu.AF.hi);
+    return 0;
 }
 
-static void _CPU_8BIT_AND(BYTE *reg, BYTE to_and)
+static int _cpu_op_ld_hli_a(WORD operand)
 {
-    *reg &= to_and;
-    _cpu.AF.lo = 0;
-    if (*reg == 0)
-    {
-        bit_set(&_cpu.AF.lo, FLAG_Z);
-    }
-    bit_set(&_cpu.AF.lo, FLAG_H);
+    (void)operand;
+    memory_write(_cpu.HL.reg, _cpu.AF.hi);
+    _CPU_16BIT_INC(&_cpu.HL.reg);
+    return 0;
 }
 
-static void _CPU_8BIT_ADD(BYTE *reg, BYTE to_add)
+static int _cpu_op_ld_hld_a(WORD operand)
 {
-    _cpu.AF.lo = 0;
-
-    BYTE before = *reg;
-    *reg += to_add;
+    (void)operand;
+    memory_write(_cpu.HL.reg, _cpu.AF.hi);
+    _CPU_16BIT_DEC(&_cpu.HL.reg);
+    return 0;
+}
 
-    if (*reg == 0)
-    {
-        bit_set(&_cpu.AF.lo, FLAG_Z);
-    }
-    // negative is unset
+static int _cpu_op_ld_a_bc(WORD operand)
+{
+    (void)operand;
+    _CPU_REG_LOAD_FROM_MEMORY(&_cpu.AF.hi, _cpu.BC.reg);
+    return 0;
+}
 
-    WORD hsum = (before & 0x0F) + (to_add & 0x0F);
+static int _cpu_op_ld_a_de(WORD operand)
+{
+    (void)operand;
+    _CPU_REG_LOAD_FROM_MEMORY(&_cpu.AF.hi, _cpu.DE.reg);
+    return 0;
+}
 
-    if (hsum & 0XF0)
-    {
-        bit_set(&_cpu.AF.lo, FLAG_H);
-    }
+static int _cpu_op_ld_a_hli(WORD operand)
+{
+    (void)operand;
+    _CPU_REG_LOAD_FROM_MEMORY(&_cpu.AF.hi, _cpu.HL.reg);
+    _CPU_16BIT_INC(&_cpu.HL.reg);
+    return 0;
+}
 
-    WORD sum = (WORD)(before + to_add);
-    // If overflow,set C flag
-    if (sum > 0xFF)
-    {
-        bit_set(&_cpu.AF.lo, FLAG_C);
-    }
+static int _cpu_op_ld_a_hld(WORD operand)
+{
+    (void)operand;
+    _CPU_REG_LOAD_FROM_MEMORY(&_cpu.AF.hi, _cpu.HL.reg);
+    _CPU_16BIT_DEC(&_cpu.HL.reg);
+    return 0;
 }
 
-static void _CPU_8BIT_ADC(BYTE *reg, BYTE to_add)
+static int _cpu_op_inc_hl_memory(WORD operand)
 {
-    BYTE carry = bit_get(_cpu.AF.lo, FLAG_C);
-    _cpu.AF.lo = 0;
-    int result = *reg + to_add + carry;
+    (void)operand;
+    BYTE stored = memory_read(_cpu.HL.reg);
+    _CPU_8BIT_INC(&stored);
+    memory_write(_cpu.HL.reg, stored);
+    return 0;
+}
 
-    if (result & 0xff00)
-    {
-        bit_set(&_cpu.AF.lo, FLAG_C);
-    }
+static int _cpu_op_dec_hl_memory(WORD operand)
+{
+    (void)operand;
+    BYTE stored = memory_read(_cpu.HL.reg);
+    _CPU_8BIT_DEC(&stored);
+    memory_write(_cpu.HL.reg, stored);
+    return 0;
+}
 
-    if (((to_add & 0x0f) + (*reg & 0x0f) + carry) > 0x0f)
-    {
-        bit_set(&_cpu.AF.lo, FLAG_H);
-    }
+static int _cpu_op_ld_nn_sp(WORD operand)
+{
+    memory_write(operand, _cpu.SP.lo);
+    memory_write(operand + 1, _cpu.SP.hi);
+    return 0;
+}
 
-    *reg = (BYTE)(result & 0xff);
+static int _cpu_op_ldh_n_a(WORD operand)
+{
+    memory_write(0xFF00 + operand, _cpu.AF.hi);
+    return 0;
+}
 
-    if (*reg == 0)
-    {
-        bit_set(&_cpu.AF.lo, FLAG_Z);
-    }
+static int _cpu_op_ldh_a_n(WORD operand)
+{
+    _CPU_REG_LOAD_FROM_MEMORY(&_cpu.AF.hi, 0xFF00 + operand);
+    return 0;
 }
 
-static void _CPU_8BIT_SUB(BYTE *reg, BYTE to_sub)
+static int _cpu_op_ldh_c_a(WORD operand)
 {
-    BYTE before = *reg;
-    *reg -= to_sub;
+    (void)operand;
+    memory_write(0xFF00 + _cpu.BC.lo, _cpu.AF.hi);
+    return 0;
+}
 
-    _cpu.AF.lo = 0;
+static int _cpu_op_ldh_a_c(WORD operand)
+{
+    (void)operand;
+    _CPU_REG_LOAD_FROM_MEMORY(&_cpu.AF.hi, 0xFF00 + _cpu.BC.lo);
+    return 0;
+}
 
-    if (*reg == 0)
-    {
-        bit_set(&_cpu.AF.lo, FLAG_Z);
-    }
+static int _cpu_op_ld_nn_a(WORD operand)
+{
+    memory_write(operand, _cpu.AF.hi);
+    return 0;
+}
 
-    bit_set(&_cpu.AF.lo, FLAG_N);
+static int _cpu_op_ld_a_nn(WORD operand)
+{
+    _CPU_REG_LOAD_FROM_MEMORY(&_cpu.AF.hi, operand);
+    return 0;
+}
 
-    // set if no borrow
-    if (before < to_sub)
-    {
-        bit_set(&_cpu.AF.lo, FLAG_C);
-    }
+static int _cpu_op_rlca(WORD operand)
+{
+    (void)operand;
+    _CPU_CORE_RLC(&_cpu.AF.hi);
+    // Have to reset zero bit, otherwise fails Blarggs 09
+    bit_reset(_cpu_flags(), FLAG_Z);
+    return 0;
+}
 
-    if ((before & 0x0F) < (to_sub & 0x0F))
-    {
-        bit_set(&_cpu.AF.lo, FLAG_H);
-    }
+static int _cpu_op_rrca(WORD operand)
+{
+    (void)operand;
+    _CPU_CORE_RRC(&_cpu.AF.hi);
+    bit_reset(_cpu_flags(), FLAG_Z);
+    return 0;
 }
 
-static void _CPU_8BIT_SUBC(BYTE *reg, BYTE to_sub)
+static int _cpu_op_rla(WORD operand)
 {
-    // BYTE before = *reg;
-    // *reg -= to_sub;
+    (void)operand;
+    _CPU_CORE_RL(&_cpu.AF.hi);
+    bit_reset(_cpu_flags(), FLAG_Z);
+    return 0;
+}
 
-    BYTE carry = bit_get(_cpu.AF.lo, FLAG_C);
-    _cpu.AF.lo = 0;
+static int _cpu_op_rra(WORD operand)
+{
+    (void)operand;
+    _CPU_CORE_RR(&_cpu.AF.hi);
+    bit_reset(_cpu_flags(), FLAG_Z);
+    return 0;
+}
 
-    bit_set(&_cpu.AF.lo, FLAG_N);
+static int _cpu_op_daa(WORD operand)
+{
+    (void)operand;
+    _CPU_CORE_DAA();
+    return 0;
+}
 
-    // set if no borrow
-    if (*reg < (to_sub + carry))
-    {
-        bit_set(&_cpu.AF.lo, FLAG_C);
-    }
+static int _cpu_op_cpl(WORD operand)
+{
+    (void)operand;
+    _cpu.AF.hi ^= 0xFF;
+    bit_set(_cpu_flags(), FLAG_N);
+    bit_set(_cpu_flags(), FLAG_H);
+    return 0;
+}
 
-    if ((*reg & 0x0F) < ((to_sub & 0x0F) + carry))
-    {
-        bit_set(&_cpu.AF.lo, FLAG_H);
-    }
+static int _cpu_op_scf(WORD operand)
+{
+    (void)operand;
+    bit_reset(_cpu_flags(), FLAG_N);
+    bit_reset(_cpu_flags(), FLAG_H);
+    bit_set(_cpu_flags(), FLAG_C);
+    return 0;
+}
 
-    *reg -= (to_sub) + carry;
-    if (*reg == 0)
-    {
-        bit_set(&_cpu.AF.lo, FLAG_Z);
-    }
+static int _cpu_op_ccf(WORD operand)
+{
+    (void)operand;
+    *_cpu_flags() ^= (0x01 << FLAG_C);
+    bit_reset(_cpu_flags(), FLAG_N);
+    bit_reset(_cpu_flags(), FLAG_H);
+    return 0;
 }
 
-static void _CPU_16BIT_ADD(WORD *reg, WORD to_add)
+static int _cpu_op_jp_hl(WORD operand)
 {
-    WORD before = *reg;
-    *reg += to_add;
+    (void)operand;
+    _cpu.PC.reg = _cpu.HL.reg;
+    return 0;
+}
 
-    bit_reset(&_cpu.AF.lo, FLAG_N);
+static int _cpu_op_reti(WORD operand)
+{
+    (void)operand;
+    _cpu.PC.reg = _pop_word_off_stack();
+    emulator_enable_interrupts_immediate();
+    return 0;
+}
 
-    uint32_t sum = (uint32_t)(before + to_add);
-    if (sum > 0XFFFF)
-    {
-        bit_set(&_cpu.AF.lo, FLAG_C);
-    }
-    else
-    {
-        bit_reset(&_cpu.AF.lo, FLAG_C);
-    }
+static int _cpu_op_add_sp_e(WORD operand)
+{
+    _cpu.SP.reg = _CPU_SP_PLUS_SIGNED_BYTE((SIGNED_BYTE)operand);
+    return 0;
+}
 
-    WORD half_sum = (before & 0xFFF) + (to_add & 0xFFF);
-    if (half_sum > 0XFFF)
-    {
-        bit_set(&_cpu.AF.lo, FLAG_H);
-    }
-    else
-    {
-        bit_reset(&_cpu.AF.lo, FLAG_H);
-    }
+static int _cpu_op_ld_hl_sp_e(WORD operand)
+{
+    _cpu.HL.reg = _CPU_SP_PLUS_SIGNED_BYTE((SIGNED_BYTE)operand);
+    return 0;
 }
 
-static void _CPU_8BIT_INC(BYTE *reg)
+static int _cpu_op_ld_sp_hl(WORD operand)
 {
-    BYTE before = *reg;
-    *reg += 1;
+    (void)operand;
+    _cpu.SP.reg = _cpu.HL.reg;
+    return 0;
+}
 
-    // If result == 0, set Zero flag
-    if (*reg == 0)
-    {
-        bit_set(&_cpu.AF.lo, FLAG_Z);
-    }
-    else
-    {
-        bit_reset(&_cpu.AF.lo, FLAG_Z);
-    }
+static int _cpu_op_halt(WORD operand)
+{
+    (void)operand;
+    emulator_halt();
+    return 0;
+}
 
-    bit_reset(&_cpu.AF.lo, FLAG_N);
+static int _cpu_op_di(WORD operand)
+{
+    (void)operand;
+    emulator_disable_interupts();
+    return 0;
+}
 
-    // If carry from bit 3 to bit 4, that is lower nibble is 1111 before increment, set half carry flag.
-    if ((before & 0XF) == 0XF)
-    {
-        bit_set(&_cpu.AF.lo, FLAG_H);
-    }
-    else
-    {
-        bit_reset(&_cpu.AF.lo, FLAG_H);
-    }
+static int _cpu_op_ei(WORD operand)
+{
+    (void)operand;
+    emulator_enable_interrupts();
+    return 0;
 }
 
-// Decrement BYTE in register, set appropriate flags
-static void _CPU_8BIT_DEC(BYTE *reg)
+// CB prefixed instructions, OP is a helper that takes a pointer to the byte to modify
+#define _CPU_DEFINE_CB(name, OP)                                         \
+    static void _cpu_cb_##name##_b() { OP(&_cpu.BC.hi); }                 \
+    static void _cpu_cb_##name##_c() { OP(&_cpu.BC.lo); }                 \
+    static void _cpu_cb_##name##_d() { OP(&_cpu.DE.hi); }                 \
+    static void _cpu_cb_##name##_e() { OP(&_cpu.DE.lo); }                 \
+    static void _cpu_cb_##name##_h() { OP(&_cpu.HL.hi); }                 \
+    static void _cpu_cb_##name##_l() { OP(&_cpu.HL.lo); }                 \
+    static void _cpu_cb_##name##_hl()                                     \
+    {                                                                     \
+        BYTE stored = memory_read(_cpu.HL.reg);                           \
+        OP(&stored);                                                      \
+        memory_write(_cpu.HL.reg, stored);                                \
+    }                                                                     \
+    static void _cpu_cb_##name##_a() { OP(&_cpu.AF.hi); }
+
+_CPU_DEFINE_CB(rlc, _CPU_CORE_RLC)
+_CPU_DEFINE_CB(rrc, _CPU_CORE_RRC)
+_CPU_DEFINE_CB(rl, _CPU_CORE_RL)
+_CPU_DEFINE_CB(rr, _CPU_CORE_RR)
+_CPU_DEFINE_CB(sla, _CPU_CORE_SLA)
+_CPU_DEFINE_CB(sra, _CPU_CORE_SRA)
+_CPU_DEFINE_CB(swap, _CPU_CORE_SWAP)
+_CPU_DEFINE_CB(srl, _CPU_CORE_SRL)
+
+#define _CPU_DEFINE_CB_BIT(bit)                                                           \
+    static void _cpu_cb_bit##bit##_b() { _CPU_TEST_BIT(_cpu.BC.hi, bit); }                 \
+    static void _cpu_cb_bit##bit##_c() { _CPU_TEST_BIT(_cpu.BC.lo, bit); }                 \
+    static void _cpu_cb_bit##bit##_d() { _CPU_TEST_BIT(_cpu.DE.hi, bit); }                 \
+    static void _cpu_cb_bit##bit##_e() { _CPU_TEST_BIT(_cpu.DE.lo, bit); }                 \
+    static void _cpu_cb_bit##bit##_h() { _CPU_TEST_BIT(_cpu.HL.hi, bit); }                 \
+    static void _cpu_cb_bit##bit##_l() { _CPU_TEST_BIT(_cpu.HL.lo, bit); }                 \
+    static void _cpu_cb_bit##bit##_hl() { _CPU_TEST_BIT(memory_read(_cpu.HL.reg), bit); }  \
+    static void _cpu_cb_bit##bit##_a() { _CPU_TEST_BIT(_cpu.AF.hi, bit); }                 \
+    static void _CPU_RESET_BIT_##bit(BYTE *reg) { _CPU_RESET_BIT(reg, bit); }              \
+    static void _CPU_SET_BIT_##bit(BYTE *reg) { _CPU_SET_BIT(reg, bit); }                  \
+    _CPU_DEFINE_CB(res##bit, _CPU_RESET_BIT_##bit)                                         \
+    _CPU_DEFINE_CB(set##bit, _CPU_SET_BIT_##bit)
+
+_CPU_DEFINE_CB_BIT(0)
+_CPU_DEFINE_CB_BIT(1)
+_CPU_DEFINE_CB_BIT(2)
+_CPU_DEFINE_CB_BIT(3)
+_CPU_DEFINE_CB_BIT(4)
+_CPU_DEFINE_CB_BIT(5)
+_CPU_DEFINE_CB_BIT(6)
+_CPU_DEFINE_CB_BIT(7)
+
+static int _cpu_op_cb(WORD operand)
 {
-    BYTE before = *reg;
-    *reg -= 1;
+    const struct cpu_cb_opcode *op = &_cpu_cb_opcodes[operand];
+    op->handler();
+    return op->cycles;
+}
 
-    // If result == 0, set Zero flag
-    if (*reg == 0)
-    {
-        bit_set(&_cpu.AF.lo, FLAG_Z);
-    }
-    else
-    {
-        bit_reset(&_cpu.AF.lo, FLAG_Z);
-    }
+// Opcode tables //////////////////////////////////////////////////////
+// A row is 8 opcodes operating on B, C, D, E, H, L, (HL), A
+#define _CPU_R8_ROW(base, prefix, cycles, hl_cycles)  \
+    [(base) + 0] = {prefix##_b, cycles, 1},           \
+    [(base) + 1] = {prefix##_c, cycles, 1},           \
+    [(base) + 2] = {prefix##_d, cycles, 1},           \
+    [(base) + 3] = {prefix##_e, cycles, 1},           \
+    [(base) + 4] = {prefix##_h, cycles, 1},           \
+    [(base) + 5] = {prefix##_l, cycles, 1},           \
+    [(base) + 6] = {prefix##_hl, hl_cycles, 1},       \
+    [(base) + 7] = {prefix##_a, cycles, 1}
+
+static const struct cpu_opcode _cpu_opcodes[256] = {
+    [0x00] = {_cpu_op_nop, 4, 1},
+    [0x01] = {_cpu_op_ld_bc_nn, 12, 3},
+    [0x02] = {_cpu_op_ld_bc_a, 8, 1},
+    [0x03] = {_cpu_op_inc_bc, 8, 1},
+    [0x04] = {_cpu_op_inc_b, 4, 1},
+    [0x05] = {_cpu_op_dec_b, 4, 1},
+    [0x06] = {_cpu_op_ld_b_n, 8, 2},
+    [0x07] = {_cpu_op_rlca, 4, 1},
+    [0x08] = {_cpu_op_ld_nn_sp, 20, 3},
+    [0x09] = {_cpu_op_add_hl_bc, 8, 1},
+    [0x0A] = {_cpu_op_ld_a_bc, 8, 1},
+    [0x0B] = {_cpu_op_dec_bc, 8, 1},
+    [0x0C] = {_cpu_op_inc_c, 4, 1},
+    [0x0D] = {_cpu_op_dec_c, 4, 1},
+    [0x0E] = {_cpu_op_ld_c_n, 8, 2},
+    [0x0F] = {_cpu_op_rrca, 4, 1},
+
+    // STOP is followed by a padding byte
+    [0x10] = {_cpu_op_nop, 4, 2},
+    [0x11] = {_cpu_op_ld_de_nn, 12, 3},
+    [0x12] = {_cpu_op_ld_de_a, 8, 1},
+    [0x13] = {_cpu_op_inc_de, 8, 1},
+    [0x14] = {_cpu_op_inc_d, 4, 1},
+    [0x15] = {_cpu_op_dec_d, 4, 1},
+    [0x16] = {_cpu_op_ld_d_n, 8, 2},
+    [0x17] = {_cpu_op_rla, 4, 1},
+    [0x18] = {_cpu_op_jr_always, 8, 2},
+    [0x19] = {_cpu_op_add_hl_de, 8, 1},
+    [0x1A] = {_cpu_op_ld_a_de, 8, 1},
+    [0x1B] = {_cpu_op_dec_de, 8, 1},
+    [0x1C] = {_cpu_op_inc_e, 4, 1},
+    [0x1D] = {_cpu_op_dec_e, 4, 1},
+    [0x1E] = {_cpu_op_ld_e_n, 8, 2},
+    [0x1F] = {_cpu_op_rra, 4, 1},
+
+    [0x20] = {_cpu_op_jr_nz, 8, 2},
+    [0x21] = {_cpu_op_ld_hl_nn, 12, 3},
+    [0x22] = {_cpu_op_ld_hli_a, 8, 1},
+    [0x23] = {_cpu_op_inc_hl, 8, 1},
+    [0x24] = {_cpu_op_inc_h, 4, 1},
+    [0x25] = {_cpu_op_dec_h, 4, 1},
+    [0x26] = {_cpu_op_ld_h_n, 8, 2},
+    [0x27] = {_cpu_op_daa, 4, 1},
+    [0x28] = {_cpu_op_jr_z, 8, 2},
+    [0x29] = {_cpu_op_add_hl_hl, 8, 1},
+    [0x2A] = {_cpu_op_ld_a_hli, 8, 1},
+    [0x2B] = {_cpu_op_dec_hl, 8, 1},
+    [0x2C] = {_cpu_op_inc_l, 4, 1},
+    [0x2D] = {_cpu_op_dec_l, 4, 1},
+    [0x2E] = {_cpu_op_ld_l_n, 8, 2},
+    [0x2F] = {_cpu_op_cpl, 4, 1},
+
+    [0x30] = {_cpu_op_jr_nc, 8, 2},
+    [0x31] = {_cpu_op_ld_sp_nn, 12, 3},
+    [0x32] = {_cpu_op_ld_hld_a, 8, 1},
+    [0x33] = {_cpu_op_inc_sp, 8, 1},
+    [0x34] = {_cpu_op_inc_hl_memory, 12, 1},
+    [0x35] = {_cpu_op_dec_hl_memory, 12, 1},
+    [0x36] = {_cpu_op_ld_hl_n, 12, 2},
+    [0x37] = {_cpu_op_scf, 4, 1},
+    [0x38] = {_cpu_op_jr_c, 8, 2},
+    [0x39] = {_cpu_op_add_hl_sp, 8, 1},
+    [0x3A] = {_cpu_op_ld_a_hld, 8, 1},
+    [0x3B] = {_cpu_op_dec_sp, 8, 1},
+    [0x3C] = {_cpu_op_inc_a, 4, 1},
+    [0x3D] = {_cpu_op_dec_a, 4, 1},
+    [0x3E] = {_cpu_op_ld_a_n, 8, 2},
+    [0x3F] = {_cpu_op_ccf, 4, 1},
+
+    _CPU_R8_ROW(0x40, _cpu_op_ld_b, 4, 8),
+    _CPU_R8_ROW(0x48, _cpu_op_ld_c, 4, 8),
+    _CPU_R8_ROW(0x50, _cpu_op_ld_d, 4, 8),
+    _CPU_R8_ROW(0x58, _cpu_op_ld_e, 4, 8),
+    _CPU_R8_ROW(0x60, _cpu_op_ld_h, 4, 8),
+    _CPU_R8_ROW(0x68, _cpu_op_ld_l, 4, 8),
+
+    [0x70] = {_cpu_op_ld_hl_b, 8, 1},
+    [0x71] = {_cpu_op_ld_hl_c, 8, 1},
+    [0x72] = {_cpu_op_ld_hl_d, 8, 1},
+    [0x73] = {_cpu_op_ld_hl_e, 8, 1},
+    [0x74] = {_cpu_op_ld_hl_h, 8, 1},
+    [0x75] = {_cpu_op_ld_hl_l, 8, 1},
+    [0x76] = {_cpu_op_halt, 4, 1},
+    [0x77] = {_cpu_op_ld_hl_a, 8, 1},
+
+    _CPU_R8_ROW(0x78, _cpu_op_ld_a, 4, 8),
+    _CPU_R8_ROW(0x80, _cpu_op_add, 4, 8),
+    _CPU_R8_ROW(0x88, _cpu_op_adc, 4, 8),
+    _CPU_R8_ROW(0x90, _cpu_op_sub, 4, 8),
+    _CPU_R8_ROW(0x98, _cpu_op_sbc, 4, 8),
+    _CPU_R8_ROW(0xA0, _cpu_op_and, 4, 8),
+    _CPU_R8_ROW(0xA8, _cpu_op_xor, 4, 8),
+    _CPU_R8_ROW(0xB0, _cpu_op_or, 4, 8),
+    _CPU_R8_ROW(0xB8, _cpu_op_cp, 4, 8),
+
+    [0xC0] = {_cpu_op_ret_nz, 8, 1},
+    [0xC1] = {_cpu_op_pop_bc, 12, 1},
+    [0xC2] = {_cpu_op_jp_nz, 12, 3},
+    [0xC3] = {_cpu_op_jp_always, 16, 3},
+    [0xC4] = {_cpu_op_call_nz, 12, 3},
+    [0xC5] = {_cpu_op_push_bc, 16, 1},
+    [0xC6] = {_cpu_op_add_n, 8, 2},
+    [0xC7] = {_cpu_op_rst_0x00, 32, 1},
+    [0xC8] = {_cpu_op_ret_z, 8, 1},
+    [0xC9] = {_cpu_op_ret_always, 4, 1},
+    [0xCA] = {_cpu_op_jp_z, 12, 3},
+    [0xCB] = {_cpu_op_cb, 0, 2},
+    [0xCC] = {_cpu_op_call_z, 12, 3},
+    [0xCD] = {_cpu_op_call_always, 12, 3},
+    [0xCE] = {_cpu_op_adc_n, 8, 2},
+    [0xCF] = {_cpu_op_rst_0x08, 32, 1},
+
+    [0xD0] = {_cpu_op_ret_nc, 8, 1},
+    [0xD1] = {_cpu_op_pop_de, 12, 1},
+    [0xD2] = {_cpu_op_jp_nc, 12, 3},
+    [0xD3] = {_cpu_op_illegal, 4, 1},
+    [0xD4] = {_cpu_op_call_nc, 12, 3},
+    [0xD5] = {_cpu_op_push_de, 16, 1},
+    [0xD6] = {_cpu_op_sub_n, 8, 2},
+    [0xD7] = {_cpu_op_rst_0x10, 32, 1},
+    [0xD8] = {_cpu_op_ret_c, 8, 1},
+    [0xD9] = {_cpu_op_reti, 16, 1},
+    [0xDA] = {_cpu_op_jp_c, 12, 3},
+    [0xDB] = {_cpu_op_illegal, 4, 1},
+    [0xDC] = {_cpu_op_call_c, 12, 3},
+    [0xDD] = {_cpu_op_illegal, 4, 1},
+    [0xDE] = {_cpu_op_sbc_n, 8, 2},
+    [0xDF] = {_cpu_op_rst_0x18, 32, 1},
+
+    [0xE0] = {_cpu_op_ldh_n_a, 12, 2},
+    [0xE1] = {_cpu_op_pop_hl, 12, 1},
+    [0xE2] = {_cpu_op_ldh_c_a, 8, 1},
+    [0xE3] = {_cpu_op_illegal, 4, 1},
+    [0xE4] = {_cpu_op_illegal, 4, 1},
+    [0xE5] = {_cpu_op_push_hl, 16, 1},
+    [0xE6] = {_cpu_op_and_n, 8, 2},
+    [0xE7] = {_cpu_op_rst_0x20, 32, 1},
+    [0xE8] = {_cpu_op_add_sp_e, 16, 2},
+    [0xE9] = {_cpu_op_jp_hl, 4, 1},
+    [0xEA] = {_cpu_op_ld_nn_a, 16, 3},
+    [0xEB] = {_cpu_op_illegal, 4, 1},
+    [0xEC] = {_cpu_op_illegal, 4, 1},
+    [0xED] = {_cpu_op_illegal, 4, 1},
+    [0xEE] = {_cpu_op_xor_n, 8, 2},
+    [0xEF] = {_cpu_op_rst_0x28, 32, 1},
+
+    [0xF0] = {_cpu_op_ldh_a_n, 12, 2},
+    [0xF1] = {_cpu_op_pop_af, 12, 1},
+    [0xF2] = {_cpu_op_ldh_a_c, 8, 1},
+    [0xF3] = {_cpu_op_di, 4, 1},
+    [0xF4] = {_cpu_op_illegal, 4, 1},
+    [0xF5] = {_cpu_op_push_af, 16, 1},
+    [0xF6] = {_cpu_op_or_n, 8, 2},
+    [0xF7] = {_cpu_op_rst_0x30, 32, 1},
+    [0xF8] = {_cpu_op_ld_hl_sp_e, 12, 2},
+    [0xF9] = {_cpu_op_ld_sp_hl, 8, 1},
+    [0xFA] = {_cpu_op_ld_a_nn, 16, 3},
+    [0xFB] = {_cpu_op_ei, 4, 1},
+    [0xFC] = {_cpu_op_illegal, 4, 1},
+    [0xFD] = {_cpu_op_illegal, 4, 1},
+    [0xFE] = {_cpu_op_cp_n, 8, 2},
+    [0xFF] = {_cpu_op_rst_0x38, 32, 1},
+};
+
+#define _CPU_CB_ROW(base, prefix, cycles, hl_cycles) \
+    [(base) + 0] = {prefix##_b, cycles},             \
+    [(base) + 1] = {prefix##_c, cycles},             \
+    [(base) + 2] = {prefix##_d, cycles},             \
+    [(base) + 3] = {prefix##_e, cycles},             \
+    [(base) + 4] = {prefix##_h, cycles},             \
+    [(base) + 5] = {prefix##_l, cycles},             \
+    [(base) + 6] = {prefix##_hl, hl_cycles},         \
+    [(base) + 7] = {prefix##_a, cycles}
+
+static const struct cpu_cb_opcode _cpu_cb_opcodes[256] = {
+    // Cycles match the reference core, including RLC (HL)
+    _CPU_CB_ROW(0x00, _cpu_cb_rlc, 8, 8),
+    _CPU_CB_ROW(0x08, _cpu_cb_rrc, 8, 16),
+    _CPU_CB_ROW(0x10, _cpu_cb_rl, 8, 16),
+    _CPU_CB_ROW(0x18, _cpu_cb_rr, 8, 16),
+    _CPU_CB_ROW(0x20, _cpu_cb_sla, 8, 16),
+    _CPU_CB_ROW(0x28, _cpu_cb_sra, 8, 16),
+    _CPU_CB_ROW(0x30, _cpu_cb_swap, 8, 16),
+    _CPU_CB_ROW(0x38, _cpu_cb_srl, 8, 16),
+
+    _CPU_CB_ROW(0x40, _cpu_cb_bit0, 8, 12),
+    _CPU_CB_ROW(0x48, _cpu_cb_bit1, 8, 12),
+    _CPU_CB_ROW(0x50, _cpu_cb_bit2, 8, 12),
+    _CPU_CB_ROW(0x58, _cpu_cb_bit3, 8, 12),
+    _CPU_CB_ROW(0x60, _cpu_cb_bit4, 8, 12),
+    _CPU_CB_ROW(0x68, _cpu_cb_bit5, 8, 12),
+    _CPU_CB_ROW(0x70, _cpu_cb_bit6, 8, 12),
+    _CPU_CB_ROW(0x78, _cpu_cb_bit7, 8, 12),
+
+    _CPU_CB_ROW(0x80, _cpu_cb_res0, 8, 16),
+    _CPU_CB_ROW(0x88, _cpu_cb_res1, 8, 16),
+    _CPU_CB_ROW(0x90, _cpu_cb_res2, 8, 16),
+    _CPU_CB_ROW(0x98, _cpu_cb_res3, 8, 16),
+    _CPU_CB_ROW(0xA0, _cpu_cb_res4, 8, 16),
+    _CPU_CB_ROW(0xA8, _cpu_cb_res5, 8, 16),
+    _CPU_CB_ROW(0xB0, _cpu_cb_res6, 8, 16),
+    _CPU_CB_ROW(0xB8, _cpu_cb_res7, 8, 16),
+
+    _CPU_CB_ROW(0xC0, _cpu_cb_set0, 8, 16),
+    _CPU_CB_ROW(0xC8, _cpu_cb_set1, 8, 16),
+    _CPU_CB_ROW(0xD0, _cpu_cb_set2, 8, 16),
+    _CPU_CB_ROW(0xD8, _cpu_cb_set3, 8, 16),
+    _CPU_CB_ROW(0xE0, _cpu_cb_set4, 8, 16),
+    _CPU_CB_ROW(0xE8, _cpu_cb_set5, 8, 16),
+    _CPU_CB_ROW(0xF0, _cpu_cb_set6, 8, 16),
+    _CPU_CB_ROW(0xF8, _cpu_cb_set7, 8, 16),
+};
+
+// Block cache ////////////////////////////////////////////////////////
+// Straight-line code is decoded once into blocks of handler, operand and cycles, keyed by PC and the bank mapped there.
+// Blocks end at control flow, at instructions that hand control back to the emulator, and never grow past the 256 byte
+// page they start in (the boot ROM overlay is only unmapped once 0x100 is read). Blocks decoded from RAM mark their bytes
+// in a bitmap, a write to a marked byte invalidates every block that covers it.
+#define CPU_BLOCK_CACHE_SIZE 2048
+#define CPU_BLOCK_MAX_INSTRUCTIONS 16
+#define CPU_BLOCK_MAX_BYTES (CPU_BLOCK_MAX_INSTRUCTIONS * 3)
+#define CPU_CODE_RAM_START 0xC000
+
+struct cpu_decoded_instruction
+{
+    cpu_opcode_handler handler;
+    WORD operand;
+    BYTE opcode;
+    BYTE length;
+    BYTE cycles;
+};
+
+struct cpu_block
+{
+    bool valid;
+    WORD pc;
+    // Address after the last instruction
+    WORD end;
+    int bank;
+    BYTE count;
+    // Base cycles of the whole block, taken branches add to it
+    int cycles;
+    struct cpu_decoded_instruction instructions[CPU_BLOCK_MAX_INSTRUCTIONS];
+    // Whether the block heads a loop that can spin without changing anything, see _cpu_is_idling
+    BYTE idle;
+    // Starts at an execute watchpoint, which are only ever at the start of a block
+    bool watched;
+#ifdef CPU_DYNAREC
+    // Entries at the start of the block, it is compiled once this reaches DYNAREC_THRESHOLD
+    int hits;
+    bool compiled;
+    // Native code for the first native_count instructions, taking at most native_cycles
+    dynarec_block native;
+    int native_count;
+    int native_cycles;
+#endif
+};
+
+static struct cpu_block _cpu_blocks[CPU_BLOCK_CACHE_SIZE];
+static BYTE _cpu_code_bitmap[(0x10000 - CPU_CODE_RAM_START) / 8];
+
+// Idle loops. A ROM block that jumps back to its own start without writing memory is detected when decoded, the idle
+// loop database can add loops spanning several blocks or with writes that are known to repeat the same value.
+enum cpu_idle_loop
+{
+    CPU_IDLE_NONE,
+    // Polls I/O registers, any event may end it
+    CPU_IDLE_POLLS_IO,
+    // Only reads RAM, nothing but an interrupt handler can end it
+    CPU_IDLE_POLLS_RAM,
+    CPU_IDLE_LISTED
+};
 
-    bit_set(&_cpu.AF.lo, FLAG_N);
+#define CPU_IDLE_LOOPS_MAX 32
 
-    // Set H if borrow from bit 4, that is lower nibble is == 0
-    if ((before & 0XF) == 0)
-    {
-        bit_set(&_cpu.AF.lo, FLAG_H);
-    }
-    else
+struct cpu_listed_idle_loop
+{
+    WORD pc;
+    int bank;
+};
+
+static struct cpu_listed_idle_loop _cpu_listed_idle_loops[CPU_IDLE_LOOPS_MAX];
+static int _cpu_listed_idle_loop_count;
+
+// Loop head entered last in this run and the registers it was entered with
+static struct cpu_block *_cpu_idle_block;
+static struct cpu_context _cpu_idle_context;
+static int _cpu_idle_start;
+// Cycles of one iteration if the last run stopped in an idle loop
+static int _cpu_idle_cycles;
+
+// Where a run stopped inside a block, so the next run continues without a lookup
+static struct cpu_block *_cpu_cursor_block;
+static int _cpu_cursor_index;
+static WORD _cpu_cursor_pc;
+
+static bool _cpu_is_cacheable(WORD address)
+{
+#ifdef CPU_REFERENCE_CORE
+    // The reference core always steps the switch
+    return false;
+#endif
+    // Reads 0xFF during OAM DMA, a block decoded now would keep those after the transfer
+    if (memory_dma_blocks(address))
     {
-        bit_reset(&_cpu.AF.lo, FLAG_H);
+        return false;
     }
+    // ROM, WRAM and HRAM. Echo, VRAM and external RAM code is rare enough to decode every time
+    return address < 0x8000 || (address >= 0xC000 && address < 0xE000) || (address >= 0xFF80 && address < 0xFFFF);
 }
 
-static void _CPU_16BIT_DEC(WORD *reg)
+static bool _cpu_ends_block(BYTE opcode)
 {
-    *reg -= 1;
+    switch (opcode)
+    {
+    case 0x10: // STOP
+    case 0x76: // HALT
+    case 0xF3: // DI
+    case 0xFB: // EI
+    case 0x18: // JR
+    case 0x20:
+    case 0x28:
+    case 0x30:
+    case 0x38:
+    case 0xC2: // JP
+    case 0xC3:
+    case 0xCA:
+    case 0xD2:
+    case 0xDA:
+    case 0xE9:
+    case 0xC4: // CALL
+    case 0xCC:
+    case 0xCD:
+    case 0xD4:
+    case 0xDC:
+    case 0xC0: // RET
+    case 0xC8:
+    case 0xC9:
+    case 0xD0:
+    case 0xD8:
+    case 0xD9:
+    case 0xC7: // RST
+    case 0xCF:
+    case 0xD7:
+    case 0xDF:
+    case 0xE7:
+    case 0xEF:
+    case 0xF7:
+    case 0xFF:
+        return true;
+    default:
+        return _cpu_opcodes[opcode].handler == _cpu_op_illegal;
+    }
 }
 
-static void _CPU_16BIT_INC(WORD *reg)
+static struct cpu_block *_cpu_block_slot(WORD pc, int bank)
 {
-    *reg += 1;
+    return &_cpu_blocks[(pc ^ (bank << 6)) & (CPU_BLOCK_CACHE_SIZE - 1)];
 }
 
-static void _CPU_8BIT_COMPARE(BYTE orig, BYTE comp)
+// Instructions that can only read memory, a loop made of these cannot change what it polls
+static bool _cpu_is_read_only(BYTE opcode, WORD operand)
 {
-    _cpu.AF.lo = 0x0;
-    if (orig == comp)
+    // LD r,r' and LD r,(HL) but not LD (HL),r or HALT
+    if (opcode >= 0x40 && opcode < 0x80)
+    {
+        return opcode < 0x70 || opcode > 0x77;
+    }
+    // ALU on A
+    if (opcode >= 0x80 && opcode < 0xC0)
     {
-        bit_set(&_cpu.AF.lo, FLAG_Z);
+        return true;
+    }
+    // Anything on a register and BIT on (HL)
+    if (opcode == 0xCB)
+    {
+        return (operand & 0x07) != 0x06 || (operand >= 0x40 && operand < 0x80);
     }
-    bit_set(&_cpu.AF.lo, FLAG_N);
 
-    if (orig < comp)
+    switch (opcode)
     {
-        bit_set(&_cpu.AF.lo, FLAG_C);
+    case 0x00: // NOP
+    case 0x01: // LD rr,nn
+    case 0x11:
+    case 0x21:
+    case 0x31:
+    case 0x03: // INC rr
+    case 0x13:
+    case 0x23:
+    case 0x33:
+    case 0x0B: // DEC rr
+    case 0x1B:
+    case 0x2B:
+    case 0x3B:
+    case 0x09: // ADD HL,rr
+    case 0x19:
+    case 0x29:
+    case 0x39:
+    case 0x04: // INC r
+    case 0x0C:
+    case 0x14:
+    case 0x1C:
+    case 0x24:
+    case 0x2C:
+    case 0x3C:
+    case 0x05: // DEC r
+    case 0x0D:
+    case 0x15:
+    case 0x1D:
+    case 0x25:
+    case 0x2D:
+    case 0x3D:
+    case 0x06: // LD r,n
+    case 0x0E:
+    case 0x16:
+    case 0x1E:
+    case 0x26:
+    case 0x2E:
+    case 0x3E:
+    case 0x0A: // LD A,(BC)
+    case 0x1A: // LD A,(DE)
+    case 0x2A: // LD A,(HL+)
+    case 0x3A: // LD A,(HL-)
+    case 0xF0: // LDH A,(n)
+    case 0xF2: // LD A,(C)
+    case 0xFA: // LD A,(nn)
+    case 0x07: // RLCA
+    case 0x0F: // RRCA
+    case 0x17: // RLA
+    case 0x1F: // RRA
+    case 0x27: // DAA
+    case 0x2F: // CPL
+    case 0x37: // SCF
+    case 0x3F: // CCF
+    case 0xC6: // ALU A,n
+    case 0xCE:
+    case 0xD6:
+    case 0xDE:
+    case 0xE6:
+    case 0xEE:
+    case 0xF6:
+    case 0xFE:
+        return true;
+    default:
+        return false;
     }
+}
 
-    SIGNED_WORD htest = orig & 0xF;
-    htest -= (comp & 0xF);
+// Whether the instruction may read an I/O register, indirect reads are assumed to
+static bool _cpu_may_read_io(BYTE opcode, WORD operand)
+{
+    switch (opcode)
+    {
+    case 0xF0: // LDH A,(n)
+        return operand < 0x80 || operand == 0xFF;
+    case 0xFA: // LD A,(nn)
+        return (operand >= 0xFF00 && operand < 0xFF80) || operand == 0xFFFF;
+    case 0x0A:
+    case 0x1A:
+    case 0x2A:
+    case 0x3A:
+    case 0xF2:
+        return true;
+    case 0xCB:
+        return (operand & 0x07) == 0x06;
+    default:
+        // LD r,(HL) and ALU A,(HL)
+        return (opcode & 0xC7) == 0x46 || (opcode & 0xC7) == 0x86;
+    }
+}
 
-    if (htest < 0)
+static BYTE _cpu_classify_idle_loop(const struct cpu_block *block)
+{
+    for (int i = 0; i < _cpu_listed_idle_loop_count; i++)
     {
-        bit_set(&_cpu.AF.lo, FLAG_H);
+        if (_cpu_listed_idle_loops[i].pc == block->pc && _cpu_listed_idle_loops[i].bank == block->bank)
+        {
+            return CPU_IDLE_LISTED;
+        }
     }
+    if (block->pc >= 0x8000 || block->bank == MEMORY_BOOT_BANK)
+    {
+        return CPU_IDLE_NONE;
+    }
+
+    // Has to end in a jump back to its own start
+    const struct cpu_decoded_instruction *last = &block->instructions[block->count - 1];
+    WORD target;
+    switch (last->opcode)
+    {
+    case 0x18: // JR
+    case 0x20:
+    case 0x28:
+    case 0x30:
+    case 0x38:
+        target = block->end + (SIGNED_BYTE)last->operand;
+        break;
+    case 0xC2: // JP
+    case 0xC3:
+    case 0xCA:
+    case 0xD2:
+    case 0xDA:
+        target = last->operand;
+        break;
+    default:
+        return CPU_IDLE_NONE;
+    }
+    if (target != block->pc)
+    {
+        return CPU_IDLE_NONE;
+    }
+
+    BYTE idle = CPU_IDLE_POLLS_RAM;
+    for (int i = 0; i < block->count - 1; i++)
+    {
+        if (!_cpu_is_read_only(block->instructions[i].opcode, block->instructions[i].operand))
+        {
+            return CPU_IDLE_NONE;
+        }
+        if (_cpu_may_read_io(block->instructions[i].opcode, block->instructions[i].operand))
+        {
+            idle = CPU_IDLE_POLLS_IO;
+        }
+    }
+    return idle;
+}
+
+static void _cpu_decode_block(struct cpu_block *block, WORD pc, int bank)
+{
+    WORD address = pc;
+
+    block->pc = pc;
+    block->bank = bank;
+    block->count = 0;
+    block->cycles = 0;
+#ifdef CPU_DYNAREC
+    block->hits = 0;
+    block->compiled = false;
+    block->native = NULL;
+#endif
+
+    while (block->count < CPU_BLOCK_MAX_INSTRUCTIONS)
+    {
+        // Only the first instruction may cross into the next page
+        if (block->count > 0 && (address >> 8) != (pc >> 8))
+        {
+            break;
+        }
+        if (block->count > 0 && memory_execute_watched(address))
+        {
+            break;
+        }
+
+        BYTE opcode = memory_read(address);
+        const struct cpu_opcode *op = &_cpu_opcodes[opcode];
+        if (block->count > 0 && ((WORD)(address + op->length - 1) >> 8) != (pc >> 8))
+        {
+            break;
+        }
+
+        struct cpu_decoded_instruction *instruction = &block->instructions[block->count];
+        instruction->handler = op->handler;
+        instruction->opcode = opcode;
+        instruction->length = op->length;
+        instruction->cycles = op->cycles;
+        instruction->operand = 0;
+        if (op->length == 2)
+        {
+            instruction->operand = memory_read(address + 1);
+        }
+        else if (op->length == 3)
+        {
+            instruction->operand = memory_read(address + 2) << 8;
+            instruction->operand |= memory_read(address + 1);
+        }
+
+        block->count += 1;
+        block->cycles += op->cycles;
+        address += op->length;
+
+        if (_cpu_ends_block(opcode))
+        {
+            break;
+        }
+    }
+    block->end = address;
+    block->valid = true;
+    block->idle = _cpu_classify_idle_loop(block);
+    block->watched = memory_execute_watched(pc);
+
+    if (pc >= CPU_CODE_RAM_START)
+    {
+        memory_protect_code(pc);
+        memory_protect_code(block->end - 1);
+        for (WORD code = pc; code != block->end; code++)
+        {
+            WORD offset = code - CPU_CODE_RAM_START;
+            _cpu_code_bitmap[offset >> 3] |= 0x01 << (offset & 0x7);
+        }
+    }
+}
+
+static struct cpu_block *_cpu_find_block(WORD pc)
+{
+    int bank = memory_code_bank(pc);
+    struct cpu_block *block = _cpu_block_slot(pc, bank);
+
+    if (!block->valid || block->pc != pc || block->bank != bank)
+    {
+        if (block == _cpu_cursor_block)
+        {
+            _cpu_cursor_block = NULL;
+        }
+        _cpu_decode_block(block, pc, bank);
+    }
+    return block;
+}
+
+void cpu_code_written(WORD address)
+{
+    WORD offset = address - CPU_CODE_RAM_START;
+    if (address < CPU_CODE_RAM_START || !(_cpu_code_bitmap[offset >> 3] & (0x01 << (offset & 0x7))))
+    {
+        return;
+    }
+
+    // Any block covering address starts at most CPU_BLOCK_MAX_BYTES before it. Bits are left set since other blocks
+    // may still cover the same bytes, a stale bit only costs this scan.
+    int bank = memory_code_bank(address);
+    for (int distance = 0; distance < CPU_BLOCK_MAX_BYTES && address - distance >= CPU_CODE_RAM_START; distance++)
+    {
+        WORD pc = address - distance;
+        struct cpu_block *block = _cpu_block_slot(pc, bank);
+        if (block->valid && block->pc == pc && block->bank == bank && address < block->end)
+        {
+            block->valid = false;
+        }
+    }
+}
+
+void cpu_flush_code_cache()
+{
+    memset(_cpu_blocks, 0, sizeof(_cpu_blocks));
+    memset(_cpu_code_bitmap, 0, sizeof(_cpu_code_bitmap));
+    _cpu_cursor_block = NULL;
+#ifdef CPU_DYNAREC
+    dynarec_flush();
+#endif
+}
+
+void cpu_add_idle_loop(WORD pc, int bank)
+{
+    assert(_cpu_listed_idle_loop_count < CPU_IDLE_LOOPS_MAX);
+    _cpu_listed_idle_loops[_cpu_listed_idle_loop_count].pc = pc;
+    _cpu_listed_idle_loops[_cpu_listed_idle_loop_count].bank = bank;
+    _cpu_listed_idle_loop_count += 1;
+    // Blocks already decoded there were classified without it
+    cpu_flush_code_cache();
+}
+
+int cpu_idle_cycles(bool *until_interrupt)
+{
+    *until_interrupt = _cpu_idle_cycles > 0 && _cpu_idle_block->idle == CPU_IDLE_POLLS_RAM;
+    return _cpu_idle_cycles;
+}
+
+void cpu_reset_idle()
+{
+    _cpu_idle_block = NULL;
+}
+
+#ifdef CPU_DYNAREC
+// Compiles blocks from ROM once they are hot. RAM code is left to the interpreter, it would need native code to notice
+// its own block being overwritten. Returns false if the cache had to be flushed to make room, block is gone then.
+static bool _cpu_compile_block(struct cpu_block *block)
+{
+    struct dynarec_instruction instructions[CPU_BLOCK_MAX_INSTRUCTIONS];
+
+    block->compiled = true;
+    if (block->pc >= 0x8000 || block->bank == MEMORY_BOOT_BANK)
+    {
+        return true;
+    }
+    if (!dynarec_has_space())
+    {
+        cpu_flush_code_cache();
+        return false;
+    }
+
+    for (int i = 0; i < block->count; i++)
+    {
+        instructions[i].opcode = block->instructions[i].opcode;
+        instructions[i].length = block->instructions[i].length;
+        instructions[i].cycles = block->instructions[i].cycles;
+        instructions[i].operand = block->instructions[i].operand;
+    }
+    block->native = dynarec_compile(block->pc, instructions, block->count, &block->native_count, &block->native_cycles);
+    return true;
+}
+
+// Runs the native prefix of block and returns the index of the instruction the interpreter continues from
+static int _cpu_run_native(struct cpu_block *block, int *cycles)
+{
+    int executed = 0;
+
+    // Native code reads F straight from the context
+    _cpu_flags();
+#ifdef CPU_DYNAREC_LOCKSTEP
+    struct cpu_context before = _cpu;
+    dynarec_journal_begin();
+#endif
+
+    int native_cycles = block->native(&_cpu, &executed);
+
+#ifdef CPU_DYNAREC_LOCKSTEP
+    // Replay the same instructions through the interpreter from the same state and compare
+    struct cpu_context native = _cpu;
+    dynarec_journal_undo();
+    _cpu = before;
+    int expected_cycles = 0;
+    for (int i = 0; i < executed; i++)
+    {
+        expected_cycles += cpu_next_execute_instruction();
+    }
+    _cpu_flags();
+    if (expected_cycles != native_cycles || memcmp(&native, &_cpu, sizeof(_cpu)) != 0 || !dynarec_journal_matches())
+    {
+        printf("Dynarec lockstep mismatch in block %x after %d instructions, cycles %d vs %d\n", block->pc, executed,
+               native_cycles, expected_cycles);
+        printf("Native  PC %x SP %x AF %x BC %x DE %x HL %x\n", native.PC.reg, native.SP.reg, native.AF.reg,
+               native.BC.reg, native.DE.reg, native.HL.reg);
+        printf("Stepped PC %x SP %x AF %x BC %x DE %x HL %x\n", _cpu.PC.reg, _cpu.SP.reg, _cpu.AF.reg, _cpu.BC.reg,
+               _cpu.DE.reg, _cpu.HL.reg);
+        assert(false);
+    }
+#endif
+
+    *cycles += native_cycles;
+    _cpu_cursor_block = NULL;
+    if (executed < block->count)
+    {
+        _cpu_cursor_block = block;
+        _cpu_cursor_index = executed;
+        _cpu_cursor_pc = _cpu.PC.reg;
+    }
+    return executed;
+}
+#endif
+
+// Run loop ///////////////////////////////////////////////////////////
+void cpu_end_run()
+{
+    _cpu_run_budget = 0;
+}
+
+#if defined(CPU_THREADED_DISPATCH) && !defined(CPU_REFERENCE_CORE)
+#ifndef __GNUC__
+#error "CPU_THREADED_DISPATCH needs labels as values (GCC or Clang)"
+#endif
+
+// Every opcode in order, used to generate the labels of the threaded interpreter
+#define _CPU_FOR_EACH_OPCODE(X)                                                                     \
+    X(00) X(01) X(02) X(03) X(04) X(05) X(06) X(07) X(08) X(09) X(0A) X(0B) X(0C) X(0D) X(0E) X(0F) \
+    X(10) X(11) X(12) X(13) X(14) X(15) X(16) X(17) X(18) X(19) X(1A) X(1B) X(1C) X(1D) X(1E) X(1F) \
+    X(20) X(21) X(22) X(23) X(24) X(25) X(26) X(27) X(28) X(29) X(2A) X(2B) X(2C) X(2D) X(2E) X(2F) \
+    X(30) X(31) X(32) X(33) X(34) X(35) X(36) X(37) X(38) X(39) X(3A) X(3B) X(3C) X(3D) X(3E) X(3F) \
+    X(40) X(41) X(42) X(43) X(44) X(45) X(46) X(47) X(48) X(49) X(4A) X(4B) X(4C) X(4D) X(4E) X(4F) \
+    X(50) X(51) X(52) X(53) X(54) X(55) X(56) X(57) X(58) X(59) X(5A) X(5B) X(5C) X(5D) X(5E) X(5F) \
+    X(60) X(61) X(62) X(63) X(64) X(65) X(66) X(67) X(68) X(69) X(6A) X(6B) X(6C) X(6D) X(6E) X(6F) \
+    X(70) X(71) X(72) X(73) X(74) X(75) X(76) X(77) X(78) X(79) X(7A) X(7B) X(7C) X(7D) X(7E) X(7F) \
+    X(80) X(81) X(82) X(83) X(84) X(85) X(86) X(87) X(88) X(89) X(8A) X(8B) X(8C) X(8D) X(8E) X(8F) \
+    X(90) X(91) X(92) X(93) X(94) X(95) X(96) X(97) X(98) X(99) X(9A) X(9B) X(9C) X(9D) X(9E) X(9F) \
+    X(A0) X(A1) X(A2) X(A3) X(A4) X(A5) X(A6) X(A7) X(A8) X(A9) X(AA) X(AB) X(AC) X(AD) X(AE) X(AF) \
+    X(B0) X(B1) X(B2) X(B3) X(B4) X(B5) X(B6) X(B7) X(B8) X(B9) X(BA) X(BB) X(BC) X(BD) X(BE) X(BF) \
+    X(C0) X(C1) X(C2) X(C3) X(C4) X(C5) X(C6) X(C7) X(C8) X(C9) X(CA) X(CB) X(CC) X(CD) X(CE) X(CF) \
+    X(D0) X(D1) X(D2) X(D3) X(D4) X(D5) X(D6) X(D7) X(D8) X(D9) X(DA) X(DB) X(DC) X(DD) X(DE) X(DF) \
+    X(E0) X(E1) X(E2) X(E3) X(E4) X(E5) X(E6) X(E7) X(E8) X(E9) X(EA) X(EB) X(EC) X(ED) X(EE) X(EF) \
+    X(F0) X(F1) X(F2) X(F3) X(F4) X(F5) X(F6) X(F7) X(F8) X(F9) X(FA) X(FB) X(FC) X(FD) X(FE) X(FF)
+
+#define _CPU_LABEL_ADDRESS(n) &&_cpu_label_##n,
+
+// Each handler ends with its own copy of the dispatch, so the host predicts the jump to the next handler per opcode
+// instead of sharing a single indirect branch between all of them.
+#define _CPU_DISPATCH()                                                                  \
+    instruction += 1;                                                                    \
+    if (cycles >= _cpu_run_budget || !block->valid || instruction == end)                \
+    {                                                                                    \
+        goto done;                                                                       \
+    }                                                                                    \
+    goto *labels[instruction->opcode]
+
+// Index into the const table is a constant, so the handler is a direct call the compiler can inline
+#define _CPU_THREADED_HANDLER(n)                                                                              \
+    _cpu_label_##n:                                                                                           \
+    _cpu.PC.reg += _cpu_opcodes[0x##n].length;                                                                \
+    _cpu_run_elapsed = cycles;                                                                                \
+    cycles += _cpu_opcodes[0x##n].cycles + _cpu_opcodes[0x##n].handler(instruction->operand);                 \
+    _CPU_DISPATCH();
+
+// Direct-threaded interpreter over the decoded block, using labels as values
+static int _cpu_run_block(struct cpu_block *block, int index, int cycles)
+{
+    static void *const labels[256] = {_CPU_FOR_EACH_OPCODE(_CPU_LABEL_ADDRESS)};
+    const struct cpu_decoded_instruction *instruction = &block->instructions[index];
+    const struct cpu_decoded_instruction *end = &block->instructions[block->count];
+
+    goto *labels[instruction->opcode];
+
+    _CPU_FOR_EACH_OPCODE(_CPU_THREADED_HANDLER)
+
+done:
+    _cpu_cursor_block = NULL;
+    if (instruction != end && block->valid)
+    {
+        _cpu_cursor_block = block;
+        _cpu_cursor_index = instruction - block->instructions;
+        _cpu_cursor_pc = _cpu.PC.reg;
+    }
+    return cycles;
+}
+#else
+static int _cpu_run_block(struct cpu_block *block, int index, int cycles)
+{
+    const struct cpu_decoded_instruction *instruction = &block->instructions[index];
+    const struct cpu_decoded_instruction *end = &block->instructions[block->count];
+
+    while (instruction != end)
+    {
+        _cpu.PC.reg += instruction->length;
+        _cpu_run_elapsed = cycles;
+        cycles += instruction->cycles + instruction->handler(instruction->operand);
+        instruction += 1;
+
+        if (cycles >= _cpu_run_budget || !block->valid)
+        {
+            break;
+        }
+    }
+
+    _cpu_cursor_block = NULL;
+    if (instruction != end && block->valid)
+    {
+        _cpu_cursor_block = block;
+        _cpu_cursor_index = instruction - block->instructions;
+        _cpu_cursor_pc = _cpu.PC.reg;
+    }
+    return cycles;
+}
+#endif
+
+// Called on entering an idle loop head. Coming back to it with the same registers, without writing memory in between,
+// means it will keep spinning until an event or interrupt changes memory. Detected loops are a single block, so any
+// other block in between starts over; listed loops may run other blocks on the way round.
+static bool _cpu_is_idling(struct cpu_block *block, int cycles)
+{
+    _cpu_flags();
+    if (_cpu_idle_block == block && memcmp(&_cpu_idle_context, &_cpu, sizeof(_cpu)) == 0)
+    {
+        _cpu_idle_cycles = cycles - _cpu_idle_start;
+        return true;
+    }
+    _cpu_idle_block = block;
+    _cpu_idle_context = _cpu;
+    _cpu_idle_start = cycles;
+    return false;
+}
+
+// Run until cycle_budget cycles have passed, something ended the run early with cpu_end_run or the cpu is spinning in
+// an idle loop, see cpu_idle_cycles
+int cpu_run(int cycle_budget)
+{
+    int cycles = 0;
+
+    _cpu_run_budget = cycle_budget;
+    _cpu_idle_block = NULL;
+    _cpu_idle_cycles = 0;
+    while (cycles < _cpu_run_budget)
+    {
+        WORD pc = _cpu.PC.reg;
+        struct cpu_block *block = _cpu_cursor_block;
+        int index = _cpu_cursor_index;
+
+        // Continue where the last run stopped if nothing moved PC in between, interrupts do. A bank switch ends the run
+        // too and may have changed the code under PC.
+        if (block == NULL || !block->valid || _cpu_cursor_pc != pc || block->bank != memory_code_bank(pc))
+        {
+            if (!_cpu_is_cacheable(pc))
+            {
+                _cpu_idle_block = NULL;
+                if (memory_execute_watched(pc))
+                {
+                    memory_watch_execute(pc);
+                }
+                _cpu_run_elapsed = cycles;
+                cycles += cpu_next_execute_instruction();
+                continue;
+            }
+            block = _cpu_find_block(pc);
+            index = 0;
+        }
+        if (index == 0 && block->watched)
+        {
+            memory_watch_execute(pc);
+        }
+        if (index == 0 && block != _cpu_idle_block && _cpu_idle_block != NULL && _cpu_idle_block->idle != CPU_IDLE_LISTED)
+        {
+            _cpu_idle_block = NULL;
+        }
+        if (index == 0 && block->idle != CPU_IDLE_NONE && _cpu_is_idling(block, cycles))
+        {
+            break;
+        }
+#ifdef CPU_DYNAREC
+        if (index == 0 && !block->compiled && ++block->hits >= DYNAREC_THRESHOLD && !_cpu_compile_block(block))
+        {
+            continue;
+        }
+        // Native code runs its whole prefix, so only enter it when that fits what is left of the budget
+        if (index == 0 && block->native != NULL && cycles + block->native_cycles <= _cpu_run_budget)
+        {
+            index = _cpu_run_native(block, &cycles);
+            if (index == block->count || cycles >= _cpu_run_budget)
+            {
+                continue;
+            }
+        }
+#endif
+        cycles = _cpu_run_block(block, index, cycles);
+    }
+    _cpu_run_elapsed = 0;
+    return cycles;
+}
+
+int cpu_run_elapsed()
+{
+    return _cpu_run_elapsed;
+}
+
+static void _CPU_DAA()
+{
+    WORD s = _cpu.AF.hi;
+
+    if (bit_test(*_cpu_flags(), FLAG_N))
+    {
+        if (bit_test(*_cpu_flags(), FLAG_H))
+            s = (s - 0x06) & 0xFF;
+        if (bit_test(*_cpu_flags(), FLAG_C))
+            s -= 0x60;
+    }
+    else
+    {
+        if (bit_test(*_cpu_flags(), FLAG_H) || (s & 0xF) > 9)
+            s += 0x06;
+        if (bit_test(*_cpu_flags(), FLAG_C) || s > 0x9F)
+            s += 0x60;
+    }
+
+    _cpu.AF.hi = s;
+    bit_reset(_cpu_flags(), FLAG_H);
+
+    if (_cpu.AF.hi)
+        bit_reset(_cpu_flags(), FLAG_Z);
+    else
+        bit_set(_cpu_flags(), FLAG_Z);
+
+    if (s >= 0x100)
+        bit_set(_cpu_flags(), FLAG_C);
+}
+// Take BYTE at PC and set register to it
+static void _CPU_8BIT_LOAD(BYTE *reg)
+{
+    BYTE value = _read_byte_at_pc();
+    *reg = value;
+    _cpu.PC.reg += 1;
+}
+
+// Take WORD at PC and set register to it
+static void _CPU_16BIT_LOAD(WORD *reg)
+{
+    WORD value = _read_word_at_pc();
+    *reg = value;
+    _cpu.PC.reg += 2;
+}
+
+// Load BYTE value to the register
+static void _CPU_REG_LOAD(BYTE *reg, BYTE val)
+{
+    *reg = val;
+}
+
+// Load a BYTE from memory into a register
+static void _CPU_REG_LOAD_FROM_MEMORY(BYTE *reg, WORD address)
+{
+    *reg = memory_read(address);
+}
+
+static void _CPU_8BIT_XOR(BYTE *reg, BYTE to_xor, bool read_byte)
+{
+    // Only for instruction 0xEE
+    if (read_byte)
+    {
+        to_xor = _read_byte_at_pc();
+        _cpu.PC.reg += 1;
+    }
+
+    *reg ^= to_xor;
+    _cpu_defer_flags(CPU_FLAGS_OR, *reg, 0, 0);
+}
+
+// OR register with value, set flags
+static void _CPU_8BIT_OR(BYTE *reg, BYTE to_or)
+{
+    *reg |= to_or;
+    _cpu_defer_flags(CPU_FLAGS_OR, *reg, 0, 0);
+}
+
+static void _CPU_8BIT_AND(BYTE *reg, BYTE to_and)
+{
+    *reg &= to_and;
+    _cpu_defer_flags(CPU_FLAGS_AND, *reg, 0, 0);
+}
+
+static void _CPU_8BIT_ADD(BYTE *reg, BYTE to_add)
+{
+    _cpu_defer_flags(CPU_FLAGS_ADD, *reg, to_add, 0);
+    *reg += to_add;
+}
+
+static void _CPU_8BIT_ADC(BYTE *reg, BYTE to_add)
+{
+    BYTE carry = bit_get(*_cpu_flags(), FLAG_C);
+    _cpu_defer_flags(CPU_FLAGS_ADD, *reg, to_add, carry);
+    *reg += to_add + carry;
+}
+
+static void _CPU_8BIT_SUB(BYTE *reg, BYTE to_sub)
+{
+    _cpu_defer_flags(CPU_FLAGS_SUB, *reg, to_sub, 0);
+    *reg -= to_sub;
+}
+
+static void _CPU_8BIT_SUBC(BYTE *reg, BYTE to_sub)
+{
+    BYTE carry = bit_get(*_cpu_flags(), FLAG_C);
+    _cpu_defer_flags(CPU_FLAGS_SUB, *reg, to_sub, carry);
+    *reg -= to_sub + carry;
+}
+
+static void _CPU_16BIT_ADD(WORD *reg, WORD to_add)
+{
+    WORD before = *reg;
+    *reg += to_add;
+
+    bit_reset(_cpu_flags(), FLAG_N);
+
+    uint32_t sum = (uint32_t)(before + to_add);
+    if (sum > 0XFFFF)
+    {
+        bit_set(_cpu_flags(), FLAG_C);
+    }
+    else
+    {
+        bit_reset(_cpu_flags(), FLAG_C);
+    }
+
+    WORD half_sum = (before & 0xFFF) + (to_add & 0xFFF);
+    if (half_sum > 0XFFF)
+    {
+        bit_set(_cpu_flags(), FLAG_H);
+    }
+    else
+    {
+        bit_reset(_cpu_flags(), FLAG_H);
+    }
+}
+
+// Add a signed byte to SP for ADD SP,e and LD HL,SP+e, flags come from the low byte addition
+static WORD _CPU_SP_PLUS_SIGNED_BYTE(SIGNED_BYTE value)
+{
+    WORD reg = _cpu.SP.reg;
+    int result = (int)(reg + value);
+
+    _cpu_set_flags(0);
+    if (((reg ^ value ^ (result & 0xFFFF)) & 0x10) == 0x10)
+        bit_set(_cpu_flags(), FLAG_H);
+    if (((reg ^ value ^ (result & 0xFFFF)) & 0x100) == 0x100)
+        bit_set(_cpu_flags(), FLAG_C);
+
+    return (WORD)result;
+}
+
+static void _CPU_8BIT_INC(BYTE *reg)
+{
+    // Carry is left alone, so whatever is pending has to be worked out first
+    _cpu_defer_flags(CPU_FLAGS_INC, *reg, 0, *_cpu_flags() & 0x1F);
+    *reg += 1;
+}
+
+// Decrement BYTE in register, set appropriate flags
+static void _CPU_8BIT_DEC(BYTE *reg)
+{
+    _cpu_defer_flags(CPU_FLAGS_DEC, *reg, 0, *_cpu_flags() & 0x1F);
+    *reg -= 1;
+}
+
+static void _CPU_16BIT_DEC(WORD *reg)
+{
+    *reg -= 1;
+}
+
+static void _CPU_16BIT_INC(WORD *reg)
+{
+    *reg += 1;
+}
+
+static void _CPU_8BIT_COMPARE(BYTE orig, BYTE comp)
+{
+    _cpu_defer_flags(CPU_FLAGS_SUB, orig, comp, 0);
 }
 
 static BYTE _CPU_JUMP_IF_CONDITION(bool condition_result, bool condition)
@@ -3211,25 +4837,25 @@ static void _CPU_TEST_BIT(BYTE reg, int bit)
 {
     if (bit_test(reg, bit))
     {
-        bit_reset(&_cpu.AF.lo, FLAG_Z);
+        bit_reset(_cpu_flags(), FLAG_Z);
     }
     else
     {
-        bit_set(&_cpu.AF.lo, FLAG_Z);
+        bit_set(_cpu_flags(), FLAG_Z);
     }
-    bit_reset(&_cpu.AF.lo, FLAG_N);
-    bit_set(&_cpu.AF.lo, FLAG_H);
+    bit_reset(_cpu_flags(), FLAG_N);
+    bit_set(_cpu_flags(), FLAG_H);
 }
 
 // Rotate byte left, set Z if result == 0, C constains bit 7 data
 static void _CPU_RL_THROUGH_CARRY(BYTE *byte)
 {
-    bool is_carry_set = bit_test(_cpu.AF.lo, FLAG_C);
-    _cpu.AF.lo = 0;
+    bool is_carry_set = bit_test(*_cpu_flags(), FLAG_C);
+    _cpu_set_flags(0);
 
     if (bit_test(*byte, 7))
     {
-        bit_set(&_cpu.AF.lo, FLAG_C);
+        bit_set(_cpu_flags(), FLAG_C);
     }
 
     *byte <<= 1;
@@ -3239,25 +4865,25 @@ static void _CPU_RL_THROUGH_CARRY(BYTE *byte)
     }
     if (*byte == 0)
     {
-        bit_set(&_cpu.AF.lo, FLAG_Z);
+        bit_set(_cpu_flags(), FLAG_Z);
     }
 }
 
 static void _CPU_RL_INTO_CARRY(BYTE *byte)
 {
-    _cpu.AF.lo = 0;
+    _cpu_set_flags(0);
     bool msb_set = bit_test(*byte, 7);
 
     *byte <<= 1;
     if (msb_set)
     {
-        bit_set(&_cpu.AF.lo, FLAG_C);
+        bit_set(_cpu_flags(), FLAG_C);
         bit_set(byte, 0);
     }
     // Have to reset zero bit in 0x07, otherwise fails Blarggs 09
     if (*byte == 0)
     {
-        bit_set(&_cpu.AF.lo, FLAG_Z);
+        bit_set(_cpu_flags(), FLAG_Z);
     }
 }
 
@@ -3267,13 +4893,13 @@ static void _CPU_SHIFT_RIGHT_INTO_CARRY_PROPOGATE(BYTE *reg)
     bool is_lsb_set = bit_test(*reg, 0);
     bool is_msb_set = bit_test(*reg, 7);
 
-    _cpu.AF.lo = 0;
+    _cpu_set_flags(0);
 
     *reg >>= 1;
 
     if (is_lsb_set)
     {
-        bit_set(&_cpu.AF.lo, FLAG_C);
+        bit_set(_cpu_flags(), FLAG_C);
     }
     // MSB doesn't change in this operation after right shift
     if (is_msb_set)
@@ -3282,7 +4908,7 @@ static void _CPU_SHIFT_RIGHT_INTO_CARRY_PROPOGATE(BYTE *reg)
     }
     if (*reg == 0)
     {
-        bit_set(&_cpu.AF.lo, FLAG_Z);
+        bit_set(_cpu_flags(), FLAG_Z);
     }
 }
 
@@ -3292,17 +4918,17 @@ static void _CPU_SHIFT_RIGHT_INTO_CARRY(BYTE *reg)
     // MSP set to zero
     bool is_lsb_set = bit_test(*reg, 0);
 
-    _cpu.AF.lo = 0;
+    _cpu_set_flags(0);
 
     *reg >>= 1;
 
     if (is_lsb_set)
     {
-        bit_set(&_cpu.AF.lo, FLAG_C);
+        bit_set(_cpu_flags(), FLAG_C);
     }
     if (*reg == 0)
     {
-        bit_set(&_cpu.AF.lo, FLAG_Z);
+        bit_set(_cpu_flags(), FLAG_Z);
     }
 }
 static void _CPU_SHIFT_LEFT_INTO_CARRY(BYTE *reg)
@@ -3310,50 +4936,50 @@ static void _CPU_SHIFT_LEFT_INTO_CARRY(BYTE *reg)
 
     bool is_msb_set = bit_test(*reg, 7);
 
-    _cpu.AF.lo = 0;
+    _cpu_set_flags(0);
 
     *reg <<= 1;
 
     if (is_msb_set)
     {
-        bit_set(&_cpu.AF.lo, FLAG_C);
+        bit_set(_cpu_flags(), FLAG_C);
     }
     if (*reg == 0)
     {
-        bit_set(&_cpu.AF.lo, FLAG_Z);
+        bit_set(_cpu_flags(), FLAG_Z);
     }
 }
 
 static void _CPU_RR_INTO_CARRY(BYTE *byte)
 {
-    _cpu.AF.lo = 0;
+    _cpu_set_flags(0);
     bool lsb_set = bit_test(*byte, 0);
 
     *byte >>= 1;
     if (lsb_set)
     {
-        bit_set(&_cpu.AF.lo, FLAG_C);
+        bit_set(_cpu_flags(), FLAG_C);
         bit_set(byte, 7);
     }
     // Have to reset zero bit in 0x07, otherwise fails Blarggs 09
     if (*byte == 0)
     {
-        bit_set(&_cpu.AF.lo, FLAG_Z);
+        bit_set(_cpu_flags(), FLAG_Z);
     }
 }
 
 static void _CPU_RR_THROUGH_CARRY(BYTE *reg)
 {
-    bool is_carry_set = bit_test(_cpu.AF.lo, FLAG_C);
+    bool is_carry_set = bit_test(*_cpu_flags(), FLAG_C);
     bool is_lsb_set = bit_test(*reg, 0);
 
-    _cpu.AF.lo = 0;
+    _cpu_set_flags(0);
 
     *reg >>= 1;
 
     if (is_lsb_set)
     {
-        bit_set(&_cpu.AF.lo, FLAG_C);
+        bit_set(_cpu_flags(), FLAG_C);
     }
     if (is_carry_set)
     {
@@ -3361,19 +4987,19 @@ static void _CPU_RR_THROUGH_CARRY(BYTE *reg)
     }
     if (*reg == 0)
     {
-        bit_set(&_cpu.AF.lo, FLAG_Z);
+        bit_set(_cpu_flags(), FLAG_Z);
     }
 }
 
 static void _CPU_SWAP_NIBBLES(BYTE *reg)
 {
-    _cpu.AF.lo = 0;
+    _cpu_set_flags(0);
 
     *reg = (((*reg & 0xF0) >> 4) | ((*reg & 0x0F) << 4));
 
     if (*reg == 0)
     {
-        bit_set(&_cpu.AF.lo, FLAG_Z);
+        bit_set(_cpu_flags(), FLAG_Z);
     }
 }
 
@@ -0,0 +1,1131 @@
+#ifdef CPU_DYNAREC
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "dynarec.h"
+#include "em_memory.h"
+
+// x86-64 dynamic recompiler for hot ROM blocks.
+//
+// Guest registers are pinned for the whole block: A in EBP, F in R15D, BC/DE/HL in R12D/R13D/R14D and the context
+// pointer in RBX, all callee saved so calls into the memory helpers leave them alone. EAX, ECX, EDX, ESI and EDI are
+// scratch. ALU results come from the host flags (LAHF gives Z, half carry and carry in the guest's meaning), and F is
+// only rebuilt when a later instruction in the block, a side exit or the block exit reads it.
+//
+// Memory goes through the helpers below, which refuse I/O and MBC addresses. The native code then leaves through a side
+// exit with PC on the refused instruction, so the interpreter runs it with the emulator's timing.
+
+#define DYNAREC_BUFFER_SIZE (4 * 1024 * 1024)
+// Enough for the largest block the cpu hands over
+#define DYNAREC_MAX_BLOCK_SIZE 4096
+
+enum dynarec_host_register
+{
+    HOST_EAX,
+    HOST_ECX,
+    HOST_EDX,
+    HOST_EBX,
+    HOST_ESP,
+    HOST_EBP,
+    HOST_ESI,
+    HOST_EDI,
+    HOST_R8,
+    HOST_R9,
+    HOST_R10,
+    HOST_R11,
+    HOST_R12,
+    HOST_R13,
+    HOST_R14,
+    HOST_R15
+};
+
+#define HOST_CONTEXT HOST_EBX
+#define HOST_A HOST_EBP
+#define HOST_F HOST_R15
+#define HOST_BC HOST_R12
+#define HOST_DE HOST_R13
+#define HOST_HL HOST_R14
+
+// x86 opcodes
+#define X86_ADD 0x01
+#define X86_OR 0x09
+#define X86_AND 0x21
+#define X86_SUB 0x29
+#define X86_XOR 0x31
+#define X86_MOV 0x89
+#define X86_MOVZX_BYTE 0xB6
+#define X86_MOVZX_WORD 0xB7
+#define X86_GROUP_ADD 0
+#define X86_GROUP_OR 1
+#define X86_GROUP_AND 4
+#define X86_GROUP_SUB 5
+#define X86_GROUP_XOR 6
+#define X86_SHL 4
+#define X86_SHR 5
+#define X86_JZ 0x84
+#define X86_JNZ 0x85
+#define X86_JNS 0x89
+
+// Guest 8-bit ALU operations in opcode order (ADD, ADC, SUB, SBC, AND, XOR, OR, CP) as x86 "op r/m8, r8" opcodes
+static const BYTE _dynarec_alu_opcodes[8] = {0x00, 0x10, 0x28, 0x18, 0x20, 0x30, 0x08, 0x38};
+#define GUEST_ALU_ADC 1
+#define GUEST_ALU_SUB 2
+#define GUEST_ALU_SBC 3
+#define GUEST_ALU_AND 4
+#define GUEST_ALU_XOR 5
+#define GUEST_ALU_OR 6
+#define GUEST_ALU_CP 7
+
+#define GUEST_REGISTER_HL 6
+#define GUEST_REGISTER_A 7
+
+// How an instruction uses F, for working out which flag results are ever read
+#define FLAGS_UNTOUCHED 0
+#define FLAGS_WRITTEN 1
+#define FLAGS_READ 2
+
+static BYTE *_dynarec_buffer = NULL;
+static size_t _dynarec_used = 0;
+
+static int _dynarec_read(WORD address);
+static int _dynarec_write(WORD address, BYTE data);
+
+void dynarec_init()
+{
+    if (_dynarec_buffer != NULL)
+    {
+        return;
+    }
+
+    _dynarec_buffer = mmap(NULL, DYNAREC_BUFFER_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS,
+                           -1, 0);
+    if (_dynarec_buffer == MAP_FAILED)
+    {
+        printf("Could not map memory for the dynarec\n");
+        assert(false);
+    }
+}
+
+void dynarec_flush()
+{
+    _dynarec_used = 0;
+}
+
+bool dynarec_has_space()
+{
+    return DYNAREC_BUFFER_SIZE - _dynarec_used >= DYNAREC_MAX_BLOCK_SIZE;
+}
+
+// Emitters ///////////////////////////////////////////////////////////
+static void _dynarec_emit8(BYTE value)
+{
+    _dynarec_buffer[_dynarec_used++] = value;
+}
+
+static void _dynarec_emit32(uint32_t value)
+{
+    memcpy(&_dynarec_buffer[_dynarec_used], &value, sizeof(value));
+    _dynarec_used += sizeof(value);
+}
+
+static void _dynarec_emit64(uint64_t value)
+{
+    memcpy(&_dynarec_buffer[_dynarec_used], &value, sizeof(value));
+    _dynarec_used += sizeof(value);
+}
+
+static void _dynarec_emit_rex(bool wide, int reg, int rm, bool byte_registers)
+{
+    BYTE rex = 0x40 | (wide << 3) | ((reg >> 3) << 2) | (rm >> 3);
+    // SPL, BPL, SIL and DIL are only reachable with a REX prefix, without one they encode AH, CH, DH and BH
+    if (rex != 0x40 || (byte_registers && ((reg & 7) >= 4 || (rm & 7) >= 4)))
+    {
+        _dynarec_emit8(rex);
+    }
+}
+
+static void _dynarec_emit_modrm(int reg, int rm)
+{
+    _dynarec_emit8(0xC0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+// [rbx + offset] addressing into struct cpu_context
+static void _dynarec_emit_modrm_context(int reg, int offset)
+{
+    _dynarec_emit8(0x40 | ((reg & 7) << 3) | HOST_CONTEXT);
+    _dynarec_emit8(offset);
+}
+
+// op rm, reg on 32-bit registers
+static void _dynarec_op(BYTE opcode, int rm, int reg)
+{
+    _dynarec_emit_rex(false, reg, rm, false);
+    _dynarec_emit8(opcode);
+    _dynarec_emit_modrm(reg, rm);
+}
+
+// op rm, imm32 for the 0x81 group
+static void _dynarec_op_immediate(int group, int rm, uint32_t value)
+{
+    _dynarec_emit_rex(false, 0, rm, false);
+    _dynarec_emit8(0x81);
+    _dynarec_emit_modrm(group, rm);
+    _dynarec_emit32(value);
+}
+
+static void _dynarec_mov_immediate(int reg, uint32_t value)
+{
+    _dynarec_emit_rex(false, 0, reg, false);
+    _dynarec_emit8(0xB8 + (reg & 7));
+    _dynarec_emit32(value);
+}
+
+static void _dynarec_shift(int group, int rm, BYTE count)
+{
+    _dynarec_emit_rex(false, 0, rm, false);
+    _dynarec_emit8(0xC1);
+    _dynarec_emit_modrm(group, rm);
+    _dynarec_emit8(count);
+}
+
+static void _dynarec_movzx(BYTE opcode, int reg, int rm)
+{
+    _dynarec_emit_rex(false, reg, rm, opcode == X86_MOVZX_BYTE);
+    _dynarec_emit8(0x0F);
+    _dynarec_emit8(opcode);
+    _dynarec_emit_modrm(reg, rm);
+}
+
+static void _dynarec_load_context(BYTE opcode, int reg, int offset)
+{
+    _dynarec_emit_rex(false, reg, HOST_CONTEXT, false);
+    _dynarec_emit8(0x0F);
+    _dynarec_emit8(opcode);
+    _dynarec_emit_modrm_context(reg, offset);
+}
+
+static void _dynarec_store_context_byte(int reg, int offset)
+{
+    _dynarec_emit_rex(false, reg, HOST_CONTEXT, true);
+    _dynarec_emit8(0x88);
+    _dynarec_emit_modrm_context(reg, offset);
+}
+
+static void _dynarec_store_context_word(int reg, int offset)
+{
+    _dynarec_emit8(0x66);
+    _dynarec_emit_rex(false, reg, HOST_CONTEXT, false);
+    _dynarec_emit8(0x89);
+    _dynarec_emit_modrm_context(reg, offset);
+}
+
+// test F, mask
+static void _dynarec_test_flags(BYTE mask)
+{
+    _dynarec_emit_rex(false, 0, HOST_F, false);
+    _dynarec_emit8(0xF7);
+    _dynarec_emit_modrm(0, HOST_F);
+    _dynarec_emit32(mask);
+}
+
+// Forward conditional jump, returns where to patch in the target
+static size_t _dynarec_jump_forward(BYTE condition)
+{
+    _dynarec_emit8(0x0F);
+    _dynarec_emit8(condition);
+    size_t at = _dynarec_used;
+    _dynarec_emit32(0);
+    return at;
+}
+
+static void _dynarec_patch_jump(size_t at)
+{
+    int32_t distance = _dynarec_used - (at + 4);
+    memcpy(&_dynarec_buffer[at], &distance, sizeof(distance));
+}
+
+static void _dynarec_call(void *function)
+{
+    // mov rax, imm64; call rax
+    _dynarec_emit8(0x48);
+    _dynarec_emit8(0xB8);
+    _dynarec_emit64((uint64_t)function);
+    _dynarec_emit8(0xFF);
+    _dynarec_emit8(0xD0);
+}
+
+// Block entry and exit ///////////////////////////////////////////////
+static void _dynarec_emit_prologue()
+{
+    // push rbx, rbp, r12-r15, keep the executed pointer in the slot that also realigns the stack for calls
+    _dynarec_emit8(0x53);
+    _dynarec_emit8(0x55);
+    _dynarec_emit8(0x41);
+    _dynarec_emit8(0x54);
+    _dynarec_emit8(0x41);
+    _dynarec_emit8(0x55);
+    _dynarec_emit8(0x41);
+    _dynarec_emit8(0x56);
+    _dynarec_emit8(0x41);
+    _dynarec_emit8(0x57);
+    // sub rsp, 8; mov [rsp], rsi; mov rbx, rdi
+    _dynarec_emit8(0x48);
+    _dynarec_emit8(0x83);
+    _dynarec_emit8(0xEC);
+    _dynarec_emit8(0x08);
+    _dynarec_emit8(0x48);
+    _dynarec_emit8(0x89);
+    _dynarec_emit8(0x34);
+    _dynarec_emit8(0x24);
+    _dynarec_emit8(0x48);
+    _dynarec_emit8(0x89);
+    _dynarec_emit8(0xFB);
+
+    _dynarec_load_context(X86_MOVZX_BYTE, HOST_A, offsetof(struct cpu_context, AF.hi));
+    _dynarec_load_context(X86_MOVZX_BYTE, HOST_F, offsetof(struct cpu_context, AF.lo));
+    _dynarec_load_context(X86_MOVZX_WORD, HOST_BC, offsetof(struct cpu_context, BC));
+    _dynarec_load_context(X86_MOVZX_WORD, HOST_DE, offsetof(struct cpu_context, DE));
+    _dynarec_load_context(X86_MOVZX_WORD, HOST_HL, offsetof(struct cpu_context, HL));
+}
+
+// Writes the guest state back and returns. PC comes from HL for JP (HL), from pc otherwise.
+static void _dynarec_emit_exit(bool pc_from_hl, WORD pc, int cycles, int executed)
+{
+    if (pc_from_hl)
+    {
+        _dynarec_store_context_word(HOST_HL, offsetof(struct cpu_context, PC));
+    }
+    else
+    {
+        // mov word [rbx + PC], imm16
+        _dynarec_emit8(0x66);
+        _dynarec_emit8(0xC7);
+        _dynarec_emit_modrm_context(0, offsetof(struct cpu_context, PC));
+        _dynarec_emit8(pc & 0xFF);
+        _dynarec_emit8(pc >> 8);
+    }
+
+    // mov rcx, [rsp]; mov dword [rcx], executed
+    _dynarec_emit8(0x48);
+    _dynarec_emit8(0x8B);
+    _dynarec_emit8(0x0C);
+    _dynarec_emit8(0x24);
+    _dynarec_emit8(0xC7);
+    _dynarec_emit8(0x01);
+    _dynarec_emit32(executed);
+
+    _dynarec_store_context_byte(HOST_A, offsetof(struct cpu_context, AF.hi));
+    _dynarec_store_context_byte(HOST_F, offsetof(struct cpu_context, AF.lo));
+    _dynarec_store_context_word(HOST_BC, offsetof(struct cpu_context, BC));
+    _dynarec_store_context_word(HOST_DE, offsetof(struct cpu_context, DE));
+    _dynarec_store_context_word(HOST_HL, offsetof(struct cpu_context, HL));
+    _dynarec_mov_immediate(HOST_EAX, cycles);
+
+    // add rsp, 8; pop r15-r12, rbp, rbx; ret
+    _dynarec_emit8(0x48);
+    _dynarec_emit8(0x83);
+    _dynarec_emit8(0xC4);
+    _dynarec_emit8(0x08);
+    _dynarec_emit8(0x41);
+    _dynarec_emit8(0x5F);
+    _dynarec_emit8(0x41);
+    _dynarec_emit8(0x5E);
+    _dynarec_emit8(0x41);
+    _dynarec_emit8(0x5D);
+    _dynarec_emit8(0x41);
+    _dynarec_emit8(0x5C);
+    _dynarec_emit8(0x5D);
+    _dynarec_emit8(0x5B);
+    _dynarec_emit8(0xC3);
+}
+
+// Guest state ////////////////////////////////////////////////////////
+static int _dynarec_pair(int guest)
+{
+    static const int pairs[6] = {HOST_BC, HOST_BC, HOST_DE, HOST_DE, HOST_HL, HOST_HL};
+    return pairs[guest];
+}
+
+// host = guest 8-bit register, zero extended
+static void _dynarec_get8(int guest, int host)
+{
+    if (guest == GUEST_REGISTER_A)
+    {
+        _dynarec_op(X86_MOV, host, HOST_A);
+    }
+    else if (guest & 1)
+    {
+        _dynarec_movzx(X86_MOVZX_BYTE, host, _dynarec_pair(guest));
+    }
+    else
+    {
+        _dynarec_op(X86_MOV, host, _dynarec_pair(guest));
+        _dynarec_shift(X86_SHR, host, 8);
+    }
+}
+
+// guest 8-bit register = host, which must hold a value below 0x100 and is clobbered
+static void _dynarec_set8(int guest, int host)
+{
+    if (guest == GUEST_REGISTER_A)
+    {
+        _dynarec_op(X86_MOV, HOST_A, host);
+    }
+    else if (guest & 1)
+    {
+        _dynarec_op_immediate(X86_GROUP_AND, _dynarec_pair(guest), 0xFF00);
+        _dynarec_op(X86_OR, _dynarec_pair(guest), host);
+    }
+    else
+    {
+        _dynarec_op_immediate(X86_GROUP_AND, _dynarec_pair(guest), 0x00FF);
+        _dynarec_shift(X86_SHL, host, 8);
+        _dynarec_op(X86_OR, _dynarec_pair(guest), host);
+    }
+}
+
+// Builds F from the host flags LAHF left in AH: Z is bit 6, the half carry bit 4 and carry bit 0.
+// set ORs in constant flags, keep is the mask of F bits the instruction leaves alone.
+static void _dynarec_flags_from_host(bool half_carry, bool carry, BYTE set, BYTE keep)
+{
+    // movzx edx, ah
+    _dynarec_emit8(0x0F);
+    _dynarec_emit8(0xB6);
+    _dynarec_emit8(0xD4);
+    if (carry)
+    {
+        _dynarec_op(X86_MOV, HOST_ECX, HOST_EDX);
+        _dynarec_op_immediate(X86_GROUP_AND, HOST_ECX, 0x01);
+        _dynarec_shift(X86_SHL, HOST_ECX, FLAG_C);
+    }
+    _dynarec_op_immediate(X86_GROUP_AND, HOST_EDX, half_carry ? 0x50 : 0x40);
+    _dynarec_shift(X86_SHL, HOST_EDX, 1);
+    if (carry)
+    {
+        _dynarec_op(X86_OR, HOST_EDX, HOST_ECX);
+    }
+    if (set)
+    {
+        _dynarec_op_immediate(X86_GROUP_OR, HOST_EDX, set);
+    }
+    if (keep)
+    {
+        _dynarec_op_immediate(X86_GROUP_AND, HOST_F, keep);
+        _dynarec_op(X86_OR, HOST_F, HOST_EDX);
+    }
+    else
+    {
+        _dynarec_op(X86_MOV, HOST_F, HOST_EDX);
+    }
+}
+
+static void _dynarec_lahf()
+{
+    _dynarec_emit8(0x9F);
+}
+
+// A = A op ECX
+static void _dynarec_emit_alu(int operation, bool flags)
+{
+    _dynarec_op(X86_MOV, HOST_EAX, HOST_A);
+    if (operation == GUEST_ALU_ADC || operation == GUEST_ALU_SBC)
+    {
+        // bt r15d, FLAG_C
+        _dynarec_emit_rex(false, 0, HOST_F, false);
+        _dynarec_emit8(0x0F);
+        _dynarec_emit8(0xBA);
+        _dynarec_emit_modrm(4, HOST_F);
+        _dynarec_emit8(FLAG_C);
+    }
+    // op al, cl
+    _dynarec_emit8(_dynarec_alu_opcodes[operation]);
+    _dynarec_emit_modrm(HOST_ECX, HOST_EAX);
+    if (flags)
+    {
+        _dynarec_lahf();
+    }
+    if (operation != GUEST_ALU_CP)
+    {
+        _dynarec_movzx(X86_MOVZX_BYTE, HOST_A, HOST_EAX);
+    }
+    if (!flags)
+    {
+        return;
+    }
+
+    switch (operation)
+    {
+    case GUEST_ALU_AND:
+        _dynarec_flags_from_host(false, false, 0x01 << FLAG_H, 0);
+        break;
+    case GUEST_ALU_XOR:
+    case GUEST_ALU_OR:
+        _dynarec_flags_from_host(false, false, 0, 0);
+        break;
+    case GUEST_ALU_SUB:
+    case GUEST_ALU_SBC:
+    case GUEST_ALU_CP:
+        _dynarec_flags_from_host(true, true, 0x01 << FLAG_N, 0);
+        break;
+    default:
+        _dynarec_flags_from_host(true, true, 0, 0);
+        break;
+    }
+}
+
+// EAX = memory_read(EDI), leaving through a side exit if the address is I/O
+static void _dynarec_emit_read(WORD pc, int cycles, int executed)
+{
+    _dynarec_call(_dynarec_read);
+    _dynarec_op(0x85, HOST_EAX, HOST_EAX);
+    size_t skip = _dynarec_jump_forward(X86_JNS);
+    _dynarec_emit_exit(false, pc, cycles, executed);
+    _dynarec_patch_jump(skip);
+}
+
+// memory_write(EDI, ESI), leaving through a side exit if the address is I/O
+static void _dynarec_emit_write(WORD pc, int cycles, int executed)
+{
+    _dynarec_call(_dynarec_write);
+    _dynarec_op(0x85, HOST_EAX, HOST_EAX);
+    size_t skip = _dynarec_jump_forward(X86_JZ);
+    _dynarec_emit_exit(false, pc, cycles, executed);
+    _dynarec_patch_jump(skip);
+}
+
+// HL += 1 or HL -= 1
+static void _dynarec_step_hl(bool increment)
+{
+    _dynarec_op_immediate(increment ? X86_GROUP_ADD : X86_GROUP_SUB, HOST_HL, 1);
+    _dynarec_movzx(X86_MOVZX_WORD, HOST_HL, HOST_HL);
+}
+
+// Memory helpers /////////////////////////////////////////////////////
+static bool _dynarec_is_io(WORD address)
+{
+    return (address >= 0xFF00 && address < 0xFF80) || address == 0xFFFF;
+}
+
+// Returns the byte at address or -1 when the interpreter has to do the read
+static int _dynarec_read(WORD address)
+{
+    if (_dynarec_is_io(address))
+    {
+        return -1;
+    }
+    return memory_read(address);
+}
+
+#ifdef CPU_DYNAREC_LOCKSTEP
+#define DYNAREC_JOURNAL_SIZE 64
+
+struct dynarec_journal_entry
+{
+    WORD address;
+    BYTE before;
+    BYTE after;
+};
+
+static struct dynarec_journal_entry _dynarec_journal[DYNAREC_JOURNAL_SIZE];
+static int _dynarec_journal_count = 0;
+
+static void _dynarec_journal_record(WORD address, BYTE data)
+{
+    assert(_dynarec_journal_count < DYNAREC_JOURNAL_SIZE);
+    _dynarec_journal[_dynarec_journal_count].address = address;
+    _dynarec_journal[_dynarec_journal_count].before = memory_direct_read(address);
+    _dynarec_journal[_dynarec_journal_count].after = data;
+    _dynarec_journal_count += 1;
+}
+#endif
+
+// Returns non zero when the interpreter has to do the write, writes to ROM are left to it as well since they switch banks
+static int _dynarec_write(WORD address, BYTE data)
+{
+    if (address < 0x8000 || _dynarec_is_io(address))
+    {
+        return 1;
+    }
+
+#ifdef CPU_DYNAREC_LOCKSTEP
+    _dynarec_journal_record(address, data);
+    if (address >= 0xE000 && address < 0xFE00)
+    {
+        _dynarec_journal_record(address - 0x2000, data);
+    }
+#endif
+    memory_write(address, data);
+    return 0;
+}
+
+void dynarec_journal_begin()
+{
+#ifdef CPU_DYNAREC_LOCKSTEP
+    _dynarec_journal_count = 0;
+#endif
+}
+
+void dynarec_journal_undo()
+{
+#ifdef CPU_DYNAREC_LOCKSTEP
+    for (int i = _dynarec_journal_count - 1; i >= 0; i--)
+    {
+        memory_direct_write(_dynarec_journal[i].address, _dynarec_journal[i].before);
+    }
+#endif
+}
+
+// Whether memory holds what the native code left in it, only the last write to each address counts
+bool dynarec_journal_matches()
+{
+#ifdef CPU_DYNAREC_LOCKSTEP
+    for (int i = 0; i < _dynarec_journal_count; i++)
+    {
+        bool overwritten = false;
+        for (int j = i + 1; j < _dynarec_journal_count; j++)
+        {
+            overwritten |= _dynarec_journal[j].address == _dynarec_journal[i].address;
+        }
+        if (!overwritten && memory_direct_read(_dynarec_journal[i].address) != _dynarec_journal[i].after)
+        {
+            printf("Dynarec wrote %x to %x, interpreter left %x\n", _dynarec_journal[i].after,
+                   _dynarec_journal[i].address, memory_direct_read(_dynarec_journal[i].address));
+            return false;
+        }
+    }
+#endif
+    return true;
+}
+
+// Compiler ///////////////////////////////////////////////////////////
+static bool _dynarec_is_branch(BYTE opcode)
+{
+    switch (opcode)
+    {
+    case 0x18:
+    case 0x20:
+    case 0x28:
+    case 0x30:
+    case 0x38:
+    case 0xC2:
+    case 0xC3:
+    case 0xCA:
+    case 0xD2:
+    case 0xDA:
+    case 0xE9:
+        return true;
+    default:
+        return false;
+    }
+}
+
+static bool _dynarec_supported(const struct dynarec_instruction *instruction)
+{
+    BYTE opcode = instruction->opcode;
+
+    if (opcode >= 0x40 && opcode < 0xC0)
+    {
+        return opcode != 0x76; // HALT
+    }
+    if (_dynarec_is_branch(opcode))
+    {
+        return true;
+    }
+
+    switch (opcode)
+    {
+    case 0x00:
+    case 0x01:
+    case 0x11:
+    case 0x21:
+    case 0x03:
+    case 0x13:
+    case 0x23:
+    case 0x0B:
+    case 0x1B:
+    case 0x2B:
+    case 0x09:
+    case 0x19:
+    case 0x29:
+    case 0x02:
+    case 0x12:
+    case 0x0A:
+    case 0x1A:
+    case 0x22:
+    case 0x32:
+    case 0x2A:
+    case 0x3A:
+    case 0x04:
+    case 0x0C:
+    case 0x14:
+    case 0x1C:
+    case 0x24:
+    case 0x2C:
+    case 0x3C:
+    case 0x05:
+    case 0x0D:
+    case 0x15:
+    case 0x1D:
+    case 0x25:
+    case 0x2D:
+    case 0x3D:
+    case 0x06:
+    case 0x0E:
+    case 0x16:
+    case 0x1E:
+    case 0x26:
+    case 0x2E:
+    case 0x3E:
+    case 0x36:
+    case 0x07:
+    case 0x0F:
+    case 0x17:
+    case 0x1F:
+    case 0x2F:
+    case 0x37:
+    case 0x3F:
+    case 0xC6:
+    case 0xCE:
+    case 0xD6:
+    case 0xDE:
+    case 0xE6:
+    case 0xEE:
+    case 0xF6:
+    case 0xFE:
+    case 0xE2:
+    case 0xF2:
+        return true;
+    case 0xE0:
+    case 0xF0:
+        // Only HRAM, the rest of the page is I/O that would always side exit
+        return !_dynarec_is_io(0xFF00 + (instruction->operand & 0xFF));
+    case 0xEA:
+        return instruction->operand >= 0x8000 && !_dynarec_is_io(instruction->operand);
+    case 0xFA:
+        return !_dynarec_is_io(instruction->operand);
+    default:
+        return false;
+    }
+}
+
+static int _dynarec_flag_use(BYTE opcode)
+{
+    if (opcode >= 0x40 && opcode < 0x80)
+    {
+        bool memory = (opcode & 0x07) == GUEST_REGISTER_HL || ((opcode >> 3) & 0x07) == GUEST_REGISTER_HL;
+        return memory ? FLAGS_READ : FLAGS_UNTOUCHED;
+    }
+    if ((opcode >= 0x80 && opcode < 0xC0) || (opcode >= 0xC6 && (opcode & 0x07) == 0x06))
+    {
+        int operation = (opcode >> 3) & 0x07;
+        bool memory = opcode < 0xC0 && (opcode & 0x07) == GUEST_REGISTER_HL;
+        if (memory || operation == GUEST_ALU_ADC || operation == GUEST_ALU_SBC)
+        {
+            return FLAGS_READ;
+        }
+        return FLAGS_WRITTEN;
+    }
+
+    switch (opcode)
+    {
+    case 0x00:
+    case 0x01:
+    case 0x11:
+    case 0x21:
+    case 0x03:
+    case 0x13:
+    case 0x23:
+    case 0x0B:
+    case 0x1B:
+    case 0x2B:
+    case 0x06:
+    case 0x0E:
+    case 0x16:
+    case 0x1E:
+    case 0x26:
+    case 0x2E:
+    case 0x3E:
+    case 0x18:
+    case 0xC3:
+    case 0xE9:
+        return FLAGS_UNTOUCHED;
+    case 0x07:
+    case 0x0F:
+        return FLAGS_WRITTEN;
+    default:
+        // Partial flag updates, flag consumers and anything that may side exit
+        return FLAGS_READ;
+    }
+}
+
+static void _dynarec_emit_rotate(BYTE opcode, bool flags)
+{
+    _dynarec_op(X86_MOV, HOST_EAX, HOST_A);
+    _dynarec_op(X86_MOV, HOST_ECX, HOST_EAX);
+    if (opcode == 0x07 || opcode == 0x17)
+    {
+        // Left, ECX = bit 7 as the new carry
+        _dynarec_shift(X86_SHR, HOST_ECX, 7);
+        _dynarec_shift(X86_SHL, HOST_EAX, 1);
+        if (opcode == 0x07)
+        {
+            _dynarec_op(X86_OR, HOST_EAX, HOST_ECX);
+        }
+        else
+        {
+            _dynarec_op(X86_MOV, HOST_EDX, HOST_F);
+            _dynarec_shift(X86_SHR, HOST_EDX, FLAG_C);
+            _dynarec_op_immediate(X86_GROUP_AND, HOST_EDX, 0x01);
+            _dynarec_op(X86_OR, HOST_EAX, HOST_EDX);
+        }
+    }
+    else
+    {
+        // Right, ECX = bit 0 as the new carry
+        _dynarec_op_immediate(X86_GROUP_AND, HOST_ECX, 0x01);
+        _dynarec_shift(X86_SHR, HOST_EAX, 1);
+        if (opcode == 0x0F)
+        {
+            _dynarec_op(X86_MOV, HOST_EDX, HOST_ECX);
+        }
+        else
+        {
+            _dynarec_op(X86_MOV, HOST_EDX, HOST_F);
+            _dynarec_shift(X86_SHR, HOST_EDX, FLAG_C);
+            _dynarec_op_immediate(X86_GROUP_AND, HOST_EDX, 0x01);
+        }
+        _dynarec_shift(X86_SHL, HOST_EDX, 7);
+        _dynarec_op(X86_OR, HOST_EAX, HOST_EDX);
+    }
+    _dynarec_movzx(X86_MOVZX_BYTE, HOST_A, HOST_EAX);
+
+    if (flags)
+    {
+        // Only the carry is left set
+        _dynarec_shift(X86_SHL, HOST_ECX, FLAG_C);
+        _dynarec_op(X86_MOV, HOST_F, HOST_ECX);
+    }
+}
+
+// ADD HL,rr. Z is kept, N reset, H is the carry out of bit 11 and C out of bit 15
+static void _dynarec_emit_add_hl(int pair, bool flags)
+{
+    _dynarec_op(X86_MOV, HOST_EAX, HOST_HL);
+    _dynarec_op(X86_MOV, HOST_ECX, pair);
+    if (flags)
+    {
+        _dynarec_op(X86_MOV, HOST_EDX, HOST_EAX);
+        _dynarec_op_immediate(X86_GROUP_AND, HOST_EDX, 0x0FFF);
+        _dynarec_op(X86_MOV, HOST_ESI, HOST_ECX);
+        _dynarec_op_immediate(X86_GROUP_AND, HOST_ESI, 0x0FFF);
+        _dynarec_op(X86_ADD, HOST_EDX, HOST_ESI);
+        _dynarec_shift(X86_SHR, HOST_EDX, 12);
+        _dynarec_shift(X86_SHL, HOST_EDX, FLAG_H);
+    }
+    _dynarec_op(X86_ADD, HOST_EAX, HOST_ECX);
+    if (flags)
+    {
+        _dynarec_op(X86_MOV, HOST_ESI, HOST_EAX);
+        _dynarec_shift(X86_SHR, HOST_ESI, 16);
+        _dynarec_shift(X86_SHL, HOST_ESI, FLAG_C);
+        _dynarec_op(X86_OR, HOST_EDX, HOST_ESI);
+        _dynarec_op_immediate(X86_GROUP_AND, HOST_F, 0x8F);
+        _dynarec_op(X86_OR, HOST_F, HOST_EDX);
+    }
+    _dynarec_movzx(X86_MOVZX_WORD, HOST_HL, HOST_EAX);
+}
+
+// Conditional branch, cycles are the same both ways apart from the extra cycles of a taken branch
+static void _dynarec_emit_conditional_exit(BYTE opcode, WORD target, WORD next, int cycles, int taken_extra,
+                                           int executed)
+{
+    // NZ, Z, NC, C
+    int condition = (opcode >> 3) & 0x03;
+    _dynarec_test_flags(condition < 2 ? 0x01 << FLAG_Z : 0x01 << FLAG_C);
+    size_t not_taken = _dynarec_jump_forward((condition & 1) ? X86_JZ : X86_JNZ);
+    _dynarec_emit_exit(false, target, cycles + taken_extra, executed);
+    _dynarec_patch_jump(not_taken);
+    _dynarec_emit_exit(false, next, cycles, executed);
+}
+
+dynarec_block dynarec_compile(WORD pc, const struct dynarec_instruction *instructions, int count, int *compiled,
+                              int *max_cycles)
+{
+    bool flags_needed[count];
+    int total = 0;
+    int n = 0;
+
+    // Longest supported prefix that still fits a run
+    while (n < count && _dynarec_supported(&instructions[n]))
+    {
+        int extra = instructions[n].opcode == 0x18 || (instructions[n].opcode & 0xE7) == 0x20 ? 4 : 0;
+        if (total + instructions[n].cycles + extra > DYNAREC_MAX_BLOCK_CYCLES)
+        {
+            break;
+        }
+        total += instructions[n].cycles;
+        n += 1;
+        if (_dynarec_is_branch(instructions[n - 1].opcode))
+        {
+            total += extra;
+            break;
+        }
+    }
+
+    *compiled = n;
+    *max_cycles = total;
+    if (n == 0)
+    {
+        return NULL;
+    }
+
+    // Flags are live at the exit, walk back to find which results are overwritten before anything reads them
+    bool live = true;
+    for (int i = n - 1; i >= 0; i--)
+    {
+        flags_needed[i] = live;
+        int use = _dynarec_flag_use(instructions[i].opcode);
+        if (use == FLAGS_READ)
+        {
+            live = true;
+        }
+        else if (use == FLAGS_WRITTEN)
+        {
+            live = false;
+        }
+    }
+
+    assert(dynarec_has_space());
+    dynarec_block block = (dynarec_block)&_dynarec_buffer[_dynarec_used];
+    _dynarec_emit_prologue();
+
+    WORD address = pc;
+    int cycles = 0;
+    for (int i = 0; i < n; i++)
+    {
+        const struct dynarec_instruction *instruction = &instructions[i];
+        BYTE opcode = instruction->opcode;
+        WORD operand = instruction->operand;
+        WORD next = address + instruction->length;
+        bool flags = flags_needed[i];
+        int dst = (opcode >> 3) & 0x07;
+        int src = opcode & 0x07;
+
+        if (opcode >= 0x40 && opcode < 0x80)
+        {
+            if (src == GUEST_REGISTER_HL)
+            {
+                _dynarec_op(X86_MOV, HOST_EDI, HOST_HL);
+                _dynarec_emit_read(address, cycles, i);
+                _dynarec_set8(dst, HOST_EAX);
+            }
+            else if (dst == GUEST_REGISTER_HL)
+            {
+                _dynarec_get8(src, HOST_ESI);
+                _dynarec_op(X86_MOV, HOST_EDI, HOST_HL);
+                _dynarec_emit_write(address, cycles, i);
+            }
+            else
+            {
+                _dynarec_get8(src, HOST_EAX);
+                _dynarec_set8(dst, HOST_EAX);
+            }
+        }
+        else if (opcode >= 0x80 && opcode < 0xC0)
+        {
+            if (src == GUEST_REGISTER_HL)
+            {
+                _dynarec_op(X86_MOV, HOST_EDI, HOST_HL);
+                _dynarec_emit_read(address, cycles, i);
+                _dynarec_op(X86_MOV, HOST_ECX, HOST_EAX);
+            }
+            else
+            {
+                _dynarec_get8(src, HOST_ECX);
+            }
+            _dynarec_emit_alu(dst, flags);
+        }
+        else if (opcode >= 0xC6 && (opcode & 0x07) == 0x06)
+        {
+            _dynarec_mov_immediate(HOST_ECX, operand & 0xFF);
+            _dynarec_emit_alu(dst, flags);
+        }
+        else
+        {
+            switch (opcode)
+            {
+            case 0x00:
+                break;
+            case 0x01:
+            case 0x11:
+            case 0x21:
+                _dynarec_mov_immediate(_dynarec_pair(dst), operand);
+                break;
+            case 0x03:
+            case 0x13:
+            case 0x23:
+            case 0x0B:
+            case 0x1B:
+            case 0x2B:
+                _dynarec_op_immediate(opcode & 0x08 ? X86_GROUP_SUB : X86_GROUP_ADD, _dynarec_pair(dst & 0x06), 1);
+                _dynarec_movzx(X86_MOVZX_WORD, _dynarec_pair(dst & 0x06), _dynarec_pair(dst & 0x06));
+                break;
+            case 0x09:
+            case 0x19:
+            case 0x29:
+                _dynarec_emit_add_hl(_dynarec_pair(dst & 0x06), flags);
+                break;
+            case 0x02:
+            case 0x12:
+                _dynarec_op(X86_MOV, HOST_EDI, _dynarec_pair(dst));
+                _dynarec_op(X86_MOV, HOST_ESI, HOST_A);
+                _dynarec_emit_write(address, cycles, i);
+                break;
+            case 0x0A:
+            case 0x1A:
+                _dynarec_op(X86_MOV, HOST_EDI, _dynarec_pair(dst & 0x06));
+                _dynarec_emit_read(address, cycles, i);
+                _dynarec_op(X86_MOV, HOST_A, HOST_EAX);
+                break;
+            case 0x22:
+            case 0x32:
+                _dynarec_op(X86_MOV, HOST_EDI, HOST_HL);
+                _dynarec_op(X86_MOV, HOST_ESI, HOST_A);
+                _dynarec_emit_write(address, cycles, i);
+                _dynarec_step_hl(opcode == 0x22);
+                break;
+            case 0x2A:
+            case 0x3A:
+                _dynarec_op(X86_MOV, HOST_EDI, HOST_HL);
+                _dynarec_emit_read(address, cycles, i);
+                _dynarec_op(X86_MOV, HOST_A, HOST_EAX);
+                _dynarec_step_hl(opcode == 0x2A);
+                break;
+            case 0x04:
+            case 0x0C:
+            case 0x14:
+            case 0x1C:
+            case 0x24:
+            case 0x2C:
+            case 0x3C:
+            case 0x05:
+            case 0x0D:
+            case 0x15:
+            case 0x1D:
+            case 0x25:
+            case 0x2D:
+            case 0x3D:
+                // x86 INC/DEC leave the carry alone and set the half carry like the guest does
+                _dynarec_get8(dst, HOST_EAX);
+                _dynarec_emit8(0xFE);
+                _dynarec_emit_modrm(src == 0x04 ? 0 : 1, HOST_EAX);
+                if (flags)
+                {
+                    _dynarec_lahf();
+                    _dynarec_flags_from_host(true, false, src == 0x04 ? 0 : 0x01 << FLAG_N, 0x1F);
+                }
+                _dynarec_movzx(X86_MOVZX_BYTE, HOST_EAX, HOST_EAX);
+                _dynarec_set8(dst, HOST_EAX);
+                break;
+            case 0x06:
+            case 0x0E:
+            case 0x16:
+            case 0x1E:
+            case 0x26:
+            case 0x2E:
+            case 0x3E:
+                _dynarec_mov_immediate(HOST_EAX, operand & 0xFF);
+                _dynarec_set8(dst, HOST_EAX);
+                break;
+            case 0x36:
+                _dynarec_op(X86_MOV, HOST_EDI, HOST_HL);
+                _dynarec_mov_immediate(HOST_ESI, operand & 0xFF);
+                _dynarec_emit_write(address, cycles, i);
+                break;
+            case 0x07:
+            case 0x0F:
+            case 0x17:
+            case 0x1F:
+                _dynarec_emit_rotate(opcode, flags);
+                break;
+            case 0x2F:
+                _dynarec_op_immediate(X86_GROUP_XOR, HOST_A, 0xFF);
+                _dynarec_op_immediate(X86_GROUP_OR, HOST_F, (0x01 << FLAG_N) | (0x01 << FLAG_H));
+                break;
+            case 0x37:
+                _dynarec_op_immediate(X86_GROUP_AND, HOST_F, ~((0x01 << FLAG_N) | (0x01 << FLAG_H)));
+                _dynarec_op_immediate(X86_GROUP_OR, HOST_F, 0x01 << FLAG_C);
+                break;
+            case 0x3F:
+                _dynarec_op_immediate(X86_GROUP_XOR, HOST_F, 0x01 << FLAG_C);
+                _dynarec_op_immediate(X86_GROUP_AND, HOST_F, ~((0x01 << FLAG_N) | (0x01 << FLAG_H)));
+                break;
+            case 0xE0:
+            case 0xEA:
+                _dynarec_mov_immediate(HOST_EDI, opcode == 0xE0 ? 0xFF00 + (operand & 0xFF) : operand);
+                _dynarec_op(X86_MOV, HOST_ESI, HOST_A);
+                _dynarec_emit_write(address, cycles, i);
+                break;
+            case 0xF0:
+            case 0xFA:
+                _dynarec_mov_immediate(HOST_EDI, opcode == 0xF0 ? 0xFF00 + (operand & 0xFF) : operand);
+                _dynarec_emit_read(address, cycles, i);
+                _dynarec_op(X86_MOV, HOST_A, HOST_EAX);
+                break;
+            case 0xE2:
+                _dynarec_movzx(X86_MOVZX_BYTE, HOST_EDI, HOST_BC);
+                _dynarec_op_immediate(X86_GROUP_OR, HOST_EDI, 0xFF00);
+                _dynarec_op(X86_MOV, HOST_ESI, HOST_A);
+                _dynarec_emit_write(address, cycles, i);
+                break;
+            case 0xF2:
+                _dynarec_movzx(X86_MOVZX_BYTE, HOST_EDI, HOST_BC);
+                _dynarec_op_immediate(X86_GROUP_OR, HOST_EDI, 0xFF00);
+                _dynarec_emit_read(address, cycles, i);
+                _dynarec_op(X86_MOV, HOST_A, HOST_EAX);
+                break;
+            case 0x18:
+                _dynarec_emit_exit(false, next + (SIGNED_BYTE)operand, cycles + instruction->cycles + 4, i + 1);
+                break;
+            case 0x20:
+            case 0x28:
+            case 0x30:
+            case 0x38:
+                _dynarec_emit_conditional_exit(opcode, next + (SIGNED_BYTE)operand, next,
+                                               cycles + instruction->cycles, 4, i + 1);
+                break;
+            case 0xC3:
+                _dynarec_emit_exit(false, operand, cycles + instruction->cycles, i + 1);
+                break;
+            case 0xC2:
+            case 0xCA:
+            case 0xD2:
+            case 0xDA:
+                _dynarec_emit_conditional_exit(opcode, operand, next, cycles + instruction->cycles, 0, i + 1);
+                break;
+            case 0xE9:
+                _dynarec_emit_exit(true, 0, cycles + instruction->cycles, i + 1);
+                break;
+            default:
+                printf("Dynarec has no code for opcode 0x%x\n", opcode);
+                assert(false);
+                break;
+            }
+        }
+
+        cycles += instruction->cycles;
+        address = next;
+    }
+
+    if (!_dynarec_is_branch(instructions[n - 1].opcode))
+    {
+        _dynarec_emit_exit(false, address, cycles, n);
+    }
+    assert(_dynarec_used <= DYNAREC_BUFFER_SIZE);
+    return block;
+}
+#endif
@@ -1,177 +1,717 @@
 #include <assert.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <string.h>
 #include "em_memory.h"
 #include "emulator.h"
+#include "cpu.h"
+#include "graphics.h"
+#include "cartridge.h"
+#include "common.h"
 
 static BYTE *memory = 0;
 static BYTE *boot = 0;
 static bool in_boot = true;
+// What page 0 reads from once the boot rom is unmapped
+static BYTE *_memory_under_boot = 0;
 
+// Page table, one entry per 256 byte page. Pages with a host pointer are read or written straight through it, a NULL
+// pointer sends the access to the page's handler instead (I/O, ROM control, restricted areas, code the cpu decoded).
+#define MEMORY_PAGES 0x100
+
+struct memory_page_table
+{
+    BYTE *read_pages[MEMORY_PAGES];
+    BYTE *write_pages[MEMORY_PAGES];
+    memory_read_handler read_handlers[MEMORY_PAGES];
+    memory_write_handler write_handlers[MEMORY_PAGES];
+};
+
+// What memory_map set up, the hardware accesses memory through this. _memory_pages is what the game sees: the same
+// with pages covered by a watchpoint or, in MEMORY_ACCURATE_DMA builds, blocked by OAM DMA sent to slow handlers.
+static struct memory_page_table _memory_map_table;
+static struct memory_page_table _memory_pages;
+
+struct memory_watchpoint
+{
+    bool used;
+    WORD first;
+    WORD last;
+    int access;
+    memory_watch_callback callback;
+};
+
+static struct memory_watchpoint _memory_watchpoints[MEMORY_WATCHPOINTS_MAX];
+// Per page, the MEMORY_WATCH_* kinds of access some watchpoint covers
+static BYTE _memory_watched_pages[MEMORY_PAGES];
+
+static struct memory_vram_dirty _memory_vram_dirty;
+
+// I/O registers and HRAM, indexed by the low byte of the address
+static memory_read_handler _memory_io_read_handlers[0x100];
+static memory_write_handler _memory_io_write_handlers[0x100];
+static BYTE _memory_io_write_masks[0x100];
+
+#ifdef MEMORY_ACCURATE_DMA
+// While an OAM DMA runs the cpu only reaches page 0xFF, I/O and HRAM
+static bool _memory_dma_active = false;
+#endif
+
+static void _memory_write_rom(WORD address, BYTE data);
+static void _memory_write_code(WORD address, BYTE data);
+static void _memory_write_vram(WORD address, BYTE data);
+static void _memory_write_oam(WORD address, BYTE data);
+static void _memory_write_io(WORD address, BYTE data);
+static void _memory_io_init();
 static void _memory_dma_transfer(BYTE data);
+static BYTE _memory_read_watched(WORD address);
+static void _memory_write_watched(WORD address, BYTE data);
+static void _memory_refresh_page(int page);
 
 void memory_init(BYTE *mem, BYTE *bootstrap)
 {
     memory = mem;
-    // Initial values
-    // memory[0xFF05] = 0x00;
-    // memory[0xFF06] = 0x00;
-    // memory[0xFF07] = 0x00;
-    // memory[0xFF10] = 0x80;
-    // memory[0xFF11] = 0xBF;
-    // memory[0xFF12] = 0xF3;
-    // memory[0xFF14] = 0xBF;
-    // memory[0xFF16] = 0x3F;
-    // memory[0xFF17] = 0x00;
-    // memory[0xFF19] = 0xBF;
-    // memory[0xFF1A] = 0x7F;
-    // memory[0xFF1B] = 0xFF;
-    // memory[0xFF1C] = 0x9F;
-    // memory[0xFF1E] = 0xBF;
-    // memory[0xFF20] = 0xFF;
-    // memory[0xFF21] = 0x00;
-    // memory[0xFF22] = 0x00;
-    // memory[0xFF23] = 0xBF;
-    // memory[0xFF24] = 0x77;
-    // memory[0xFF25] = 0xF3;
-    // memory[0xFF26] = 0xF1;
-    // memory[0xFF40] = 0x91;
-    // memory[0xFF42] = 0x00;
-    // memory[0xFF43] = 0x00;
-
-    // // Temp memory setup for blarggs
-    // memory[0xFF44] = 0x99;
-    // printf("memory[FF44] = %x\n", memory[0XFF44]);
-    // //
-    // memory[0xFF45] = 0x00;
-    // memory[0xFF47] = 0xFC;
-    // memory[0xFF48] = 0xFF;
-    // memory[0xFF49] = 0xFF;
-    // memory[0xFF4A] = 0x00;
-    // memory[0xFF4B] = 0x00;
-    // memory[0xFFFF] = 0x00;
     boot = bootstrap;
+    in_boot = boot != NULL;
+    if (in_boot)
+    {
+        _memory_map_table.read_pages[0x00] = boot;
+    }
+
+    // The cartridge maps its ROM and external RAM over 0x0000-0x7FFF and 0xA000-0xBFFF when it is loaded
+    memory_map(0x0000, 0x8000, &memory[0x0000], NULL, NULL, _memory_write_rom);
+    memory_map(0x8000, 0x2000, &memory[0x8000], NULL, NULL, _memory_write_vram);
+    memory_map(0xA000, 0x4000, &memory[0xA000], &memory[0xA000], NULL, NULL);
+    // Echo RAM is the same WRAM seen a second time
+    memory_map(0xE000, 0x1E00, &memory[0xC000], &memory[0xC000], NULL, NULL);
+    memory_map(0xFE00, 0x0100, &memory[0xFE00], NULL, NULL, _memory_write_oam);
+    memory_map(0xFF00, 0x0100, &memory[0xFF00], NULL, NULL, _memory_write_io);
+    _memory_io_init();
 }
 
-BYTE memory_read(WORD address)
+// I/O registers as the DMG boot rom leaves them
+static const struct
 {
-    if (in_boot)
+    WORD address;
+    BYTE data;
+} _memory_post_boot_io[] = {
+    {0xFF00, 0xCF}, {0xFF02, 0x7E}, {0xFF04, 0xAB}, {0xFF07, 0xF8}, {0xFF0F, 0xE1}, {0xFF10, 0x80}, {0xFF11, 0xBF},
+    {0xFF12, 0xF3}, {0xFF13, 0xFF}, {0xFF14, 0xBF}, {0xFF16, 0x3F}, {0xFF18, 0xFF}, {0xFF19, 0xBF}, {0xFF1A, 0x7F},
+    {0xFF1B, 0xFF}, {0xFF1C, 0x9F}, {0xFF1D, 0xFF}, {0xFF1E, 0xBF}, {0xFF20, 0xFF}, {0xFF23, 0xBF}, {0xFF24, 0x77},
+    {0xFF25, 0xF3}, {0xFF26, 0xF1}, {0xFF40, 0x91}, {0xFF41, 0x85}, {0xFF46, 0xFF}, {0xFF47, 0xFC}, {0xFF48, 0xFF},
+    {0xFF49, 0xFF}, {0xFF50, 0x01},
+};
+
+// Start from the state the boot rom leaves behind instead of running one, memory_init has to be given no boot rom
+void memory_skip_boot()
+{
+    assert(!in_boot);
+    for (size_t i = 0; i < sizeof(_memory_post_boot_io) / sizeof(_memory_post_boot_io[0]); i++)
+    {
+        memory[_memory_post_boot_io[i].address] = _memory_post_boot_io[i].data;
+    }
+    // Loads the palettes and turns the LCD on
+    for (WORD address = BACKGROUND_PALETTE_ADDRESS; address <= SPRITE_PALETTE_1_ADDRESS; address++)
+    {
+        graphics_register_written(address);
+    }
+    graphics_register_written(LCD_CONTROL_ADDRESS);
+}
+
+void memory_map(WORD address, int size, BYTE *read, BYTE *write, memory_read_handler read_handler,
+                memory_write_handler write_handler)
+{
+    assert((address & 0xFF) == 0 && (size & 0xFF) == 0 && address + size <= 0x10000);
+    struct memory_page_table *table = &_memory_map_table;
+    for (int offset = 0; offset < size; offset += 0x100)
     {
-        if (address < 0x100)
+        int page = (address + offset) >> 8;
+        BYTE *read_page = read != NULL ? read + offset : NULL;
+
+        // The boot rom stays on top until it unmaps itself
+        if (page == 0x00 && in_boot)
         {
-            return boot[address];
+            _memory_under_boot = read_page;
         }
-        else if (address == 0x100)
+        else
         {
-            in_boot = false;
+            table->read_pages[page] = read_page;
         }
+        table->write_pages[page] = write != NULL ? write + offset : NULL;
+        table->read_handlers[page] = read_handler;
+        table->write_handlers[page] = write_handler;
+        _memory_refresh_page(page);
     }
-    return memory[address];
+}
+
+BYTE memory_read(WORD address)
+{
+    BYTE *page = _memory_pages.read_pages[address >> 8];
+    if (page != NULL)
+    {
+        return page[address & 0xFF];
+    }
+    return _memory_pages.read_handlers[address >> 8](address);
 }
 
 void memory_write(WORD address, BYTE data)
 {
-    if (address == SCANLINE_ADDRESS)
+    BYTE *page = _memory_pages.write_pages[address >> 8];
+    if (page != NULL)
+    {
+        page[address & 0xFF] = data;
+        return;
+    }
+    _memory_pages.write_handlers[address >> 8](address, data);
+}
+
+// Echo addresses are stored in the WRAM they mirror
+static WORD _memory_backing_address(WORD address)
+{
+    return address >= 0xE000 && address < 0xFE00 ? address - 0x2000 : address;
+}
+
+static void _memory_protect_page(int page)
+{
+    if (_memory_map_table.write_pages[page] != NULL)
+    {
+        _memory_map_table.write_pages[page] = NULL;
+        _memory_map_table.write_handlers[page] = _memory_write_code;
+        _memory_refresh_page(page);
+    }
+}
+
+void memory_protect_code(WORD address)
+{
+    _memory_protect_page(address >> 8);
+    // The echo of a WRAM page writes the same bytes
+    if (address >= 0xC000 && address < 0xDE00)
     {
-        printf("Game wrote to scanline\n");
-        // When a game writes to the SCANLINE_ADDRESS, it starts re-rendering from the 0th scanline
-        memory[address] = 0;
+        _memory_protect_page((address + 0x2000) >> 8);
     }
-    else if (address == DIVIDER_REGISTER_ADDRESS)
+}
+
+// dont allow any writing to the read only memory
+static void _memory_write_rom(WORD address, BYTE data)
+{
+    (void)address;
+    (void)data;
+}
+
+static void _memory_write_code(WORD address, BYTE data)
+{
+    address = _memory_backing_address(address);
+    memory[address] = data;
+    // Game may be overwriting code the cpu has decoded
+    cpu_code_written(address);
+}
+
+static void _memory_mark_vram(WORD address)
+{
+    if (address < 0x9800)
     {
-        // Gameboy resets divider register when a game writes to it
-        memory[DIVIDER_REGISTER_ADDRESS] = 0;
+        int tile = (address - 0x8000) >> 4;
+        _memory_vram_dirty.tiles[tile >> 3] |= 0x01 << (tile & 0x7);
     }
-    else if (address == DMA_ADDRESS)
+    else
     {
-        // game launches a DMA for sprites when it attempts to write to memory address DMA_ADDRESS
-        _memory_dma_transfer(data);
+        int entry = address & (MEMORY_TILE_MAP_SIZE - 1);
+        _memory_vram_dirty.maps[(address - 0x9800) / MEMORY_TILE_MAP_SIZE][entry >> 3] |= 0x01 << (entry & 0x7);
     }
-    else if (address == TIMER_CONTROLLER_ADDRESS)
+    _memory_vram_dirty.any = true;
+}
+
+// Writes that leave a byte as it was do not dirty anything
+static void _memory_write_vram(WORD address, BYTE data)
+{
+    if (memory[address] != data)
     {
-        // Game is changing the timer frequencey
         memory[address] = data;
+        _memory_mark_vram(address);
+    }
+}
 
-        int timerVal = data & 0x03;
+void memory_take_vram_dirty(struct memory_vram_dirty *dirty)
+{
+    *dirty = _memory_vram_dirty;
+    memset(&_memory_vram_dirty, 0, sizeof(_memory_vram_dirty));
+}
 
-        int clockSpeed = 0;
+// FEA0-FEFE is restricted
+static void _memory_write_oam(WORD address, BYTE data)
+{
+    if (address < 0xFEA0 || address == 0xFEFF)
+    {
+        memory[address] = data;
+    }
+}
 
-        switch (timerVal)
-        {
-        case 0:
-            clockSpeed = 1024;
-            break;
-        case 1:
-            clockSpeed = 16;
-            break;
-        case 2:
-            clockSpeed = 64;
-            break;
-        case 3:
-            clockSpeed = 256;
-            break; // 256
-        default:
-            assert(false);
-            break; // weird timer val
-        }
+// Handlers for single I/O registers, data has already been through the register's write mask
 
-        if (clockSpeed != emulator_get_clock_speed())
-        {
-            emulator_set_clock_speed(clockSpeed);
-        }
+static void _memory_write_register(WORD address, BYTE data)
+{
+    memory[address] = data;
+}
+
+static void _memory_write_hram(WORD address, BYTE data)
+{
+    memory[address] = data;
+    // HRAM may hold code the cpu has decoded
+    cpu_code_written(address);
+}
+
+static void _memory_write_scanline(WORD address, BYTE data)
+{
+    (void)data;
+    // When a game writes to the SCANLINE_ADDRESS, it starts re-rendering from the 0th scanline
+    memory[address] = 0;
+}
+
+static BYTE _memory_read_divider(WORD address)
+{
+    (void)address;
+    return emulator_read_divider();
+}
+
+static void _memory_write_divider(WORD address, BYTE data)
+{
+    (void)address;
+    (void)data;
+    // Gameboy resets divider register when a game writes to it
+    emulator_reset_divider();
+}
+
+static BYTE _memory_read_timer(WORD address)
+{
+    (void)address;
+    return emulator_read_timer();
+}
+
+static void _memory_write_timer(WORD address, BYTE data)
+{
+    (void)address;
+    emulator_write_timer(data);
+}
+
+static void _memory_write_dma(WORD address, BYTE data)
+{
+    (void)address;
+    // game launches a DMA for sprites when it attempts to write to memory address DMA_ADDRESS
+    _memory_dma_transfer(data);
+}
+
+static void _memory_write_timer_controller(WORD address, BYTE data)
+{
+    // Game is changing the timer frequencey
+    bool was_enabled = bit_test(memory[address], 2);
+    memory[address] = data;
+
+    int timerVal = data & 0x03;
+
+    int clockSpeed = 0;
+
+    switch (timerVal)
+    {
+    case 0:
+        clockSpeed = 1024;
+        break;
+    case 1:
+        clockSpeed = 16;
+        break;
+    case 2:
+        clockSpeed = 64;
+        break;
+    case 3:
+        clockSpeed = 256;
+        break; // 256
+    default:
+        assert(false);
+        break; // weird timer val
     }
-    // dont allow any writing to the read only memory
-    else if (address < 0x8000)
+
+    // Restarts the timer, so only when it actually changes
+    if (clockSpeed != emulator_get_clock_speed() || was_enabled != bit_test(data, 2))
     {
+        emulator_set_clock_speed(clockSpeed);
     }
+}
+
+static void _memory_write_lcd(WORD address, BYTE data)
+{
+    memory[address] = data;
+    graphics_register_written(address);
+}
 
-    // writing to ECHO ram also writes in RAM
-    else if ((address >= 0xE000) && (address < 0xFE00))
+static void _memory_write_serial_control(WORD address, BYTE data)
+{
+    memory[address] = data;
+    // Transfer requested using the internal clock
+    if (bit_test(data, 7) && bit_test(data, 0))
     {
-        memory[address] = data;
-        memory_write(address - 0x2000, data);
+        emulator_start_serial_transfer();
     }
+}
 
-    // this area is restricted
-    else if ((address >= 0xFEA0) && (address < 0xFEFF))
+static void _memory_write_boot_disable(WORD address, BYTE data)
+{
+    // The boot rom unmaps itself as its last instruction, code decoded from it is stale after that
+    memory[address] = data;
+    if (in_boot && data != 0)
     {
+        in_boot = false;
+        _memory_map_table.read_pages[0x00] = _memory_under_boot;
+        _memory_refresh_page(0x00);
+        cpu_flush_code_cache();
     }
+}
 
-    // no control needed over this area so write to memory
-    else
+static void _memory_write_interrupts(WORD address, BYTE data)
+{
+    // An interrupt may now be due, stop the current run so it is serviced
+    memory[address] = data;
+    cpu_end_run();
+}
+
+static BYTE _memory_read_io(WORD address)
+{
+    memory_read_handler handler = _memory_io_read_handlers[address & 0xFF];
+    return handler != NULL ? handler(address) : memory[address];
+}
+
+// One indexed call whatever the register, bits outside the write mask keep their value
+static void _memory_write_io(WORD address, BYTE data)
+{
+    BYTE reg = address & 0xFF;
+    BYTE mask = _memory_io_write_masks[reg];
+    _memory_io_write_handlers[reg](address, (data & mask) | (memory[address] & ~mask));
+}
+
+// Page 0xFF is read straight from memory until a register needs a read handler, HRAM shares the page
+static void _memory_io_register(WORD address, BYTE write_mask, memory_read_handler read, memory_write_handler write)
+{
+    _memory_io_write_masks[address & 0xFF] = write_mask;
+    _memory_io_write_handlers[address & 0xFF] = write;
+    if (read != NULL)
     {
-        memory[address] = data;
+        _memory_io_read_handlers[address & 0xFF] = read;
+        memory_map(0xFF00, 0x0100, NULL, NULL, _memory_read_io, _memory_write_io);
+    }
+}
+
+static void _memory_io_init()
+{
+    for (int reg = 0x00; reg <= 0xFF; reg++)
+    {
+        _memory_io_read_handlers[reg] = NULL;
+        _memory_io_write_masks[reg] = 0xFF;
+        _memory_io_write_handlers[reg] = reg >= 0x80 ? _memory_write_hram : _memory_write_register;
+    }
+    _memory_io_register(SCANLINE_ADDRESS, 0xFF, NULL, _memory_write_scanline);
+    // DIV and TIMA belong to the emulator, which counts them from the cycle they are read in
+    _memory_io_register(DIVIDER_REGISTER_ADDRESS, 0xFF, _memory_read_divider, _memory_write_divider);
+    _memory_io_register(TIMA, 0xFF, _memory_read_timer, _memory_write_timer);
+    _memory_io_register(DMA_ADDRESS, 0xFF, NULL, _memory_write_dma);
+    _memory_io_register(TIMER_CONTROLLER_ADDRESS, 0xFF, NULL, _memory_write_timer_controller);
+    // The mode and coincidence bits are read only
+    _memory_io_register(LCD_STATUS_ADDRESS, 0xF8, NULL, _memory_write_register);
+    _memory_io_register(LCD_CONTROL_ADDRESS, 0xFF, NULL, _memory_write_lcd);
+    _memory_io_register(LCD_COMPARE_ADDRESS, 0xFF, NULL, _memory_write_lcd);
+    _memory_io_register(BACKGROUND_PALETTE_ADDRESS, 0xFF, NULL, _memory_write_lcd);
+    _memory_io_register(SPRITE_PALETTE_0_ADDRESS, 0xFF, NULL, _memory_write_lcd);
+    _memory_io_register(SPRITE_PALETTE_1_ADDRESS, 0xFF, NULL, _memory_write_lcd);
+    _memory_io_register(SERIAL_CONTROL_ADDRESS, 0xFF, NULL, _memory_write_serial_control);
+    _memory_io_register(BOOT_ROM_DISABLE_ADDRESS, 0xFF, NULL, _memory_write_boot_disable);
+    _memory_io_register(INTERRUPT_REGISTER_ADDRESS, 0xFF, NULL, _memory_write_interrupts);
+    _memory_io_register(INTERRUPT_ENABLED_ADDRESS, 0xFF, NULL, _memory_write_interrupts);
+}
+
+// Identifies what is mapped at address, so code decoded from the boot rom or another bank is not reused
+int memory_code_bank(WORD address)
+{
+    if (in_boot && address < 0x100)
+    {
+        return MEMORY_BOOT_BANK;
+    }
+    if (address < 0x8000)
+    {
+        return cartridge_rom_bank(address);
     }
+    return 0;
 }
 
 // ONLY USED WHEN THE HARDWARE CHAGES MEMORY AND NOT THE GAME
 void memory_direct_write(WORD address, BYTE data)
 {
-    memory[address] = data;
+    BYTE *page = _memory_map_table.write_pages[address >> 8];
+    if (page != NULL)
+    {
+        page[address & 0xFF] = data;
+        return;
+    }
+    if (address >= 0x8000 && address < 0xA000)
+    {
+        _memory_write_vram(address, data);
+        return;
+    }
+    memory[_memory_backing_address(address)] = data;
 }
 
 BYTE memory_direct_read(WORD address)
 {
-    if (in_boot)
+    BYTE *page = _memory_map_table.read_pages[address >> 8];
+    if (page != NULL)
+    {
+        return page[address & 0xFF];
+    }
+    return memory[address];
+}
+
+// For context, refer to http://www.codeslinger.co.uk/pages/projects/gameboy/dma.html
+// Copies the 0xA0 bytes of sprite attributes from data * 0x100 in one go when the source page is mapped to memory
+static void _memory_copy_oam(BYTE data)
+{
+    WORD address = data << 8;
+    BYTE *page = _memory_map_table.read_pages[data];
+    if (page != NULL)
+    {
+        memcpy(&memory[0xFE00], page, 0xA0);
+        return;
+    }
+    for (int i = 0; i < 0xA0; i++)
     {
-        if (address < 0x100)
+        memory[0xFE00 + i] = memory_read(address + i);
+    }
+}
+
+#ifdef MEMORY_ACCURATE_DMA
+static BYTE _memory_read_blocked(WORD address)
+{
+    (void)address;
+    return 0xFF;
+}
+
+static void _memory_write_blocked(WORD address, BYTE data)
+{
+    (void)address;
+    (void)data;
+}
+
+// Takes DMA_TRANSFER_CYCLES, the bus is the DMA's until memory_finish_oam_dma
+static void _memory_dma_transfer(BYTE data)
+{
+    // A write during a transfer restarts it
+    if (!_memory_dma_active)
+    {
+        _memory_dma_active = true;
+        for (int page = 0x00; page < 0xFF; page++)
         {
-            return boot[address];
+            _memory_refresh_page(page);
         }
-        else if (address == 0x100)
+    }
+    memory[DMA_ADDRESS] = data;
+    emulator_start_oam_dma();
+    // The run was sized before the transfer was scheduled
+    cpu_end_run();
+}
+
+void memory_finish_oam_dma()
+{
+    assert(_memory_dma_active);
+    _memory_dma_active = false;
+    for (int page = 0x00; page < 0xFF; page++)
+    {
+        _memory_refresh_page(page);
+    }
+    _memory_copy_oam(memory[DMA_ADDRESS]);
+}
+
+bool memory_dma_blocks(WORD address)
+{
+    return _memory_dma_active && address < 0xFF00;
+}
+#else
+static void _memory_dma_transfer(BYTE data)
+{
+    memory[DMA_ADDRESS] = data;
+    _memory_copy_oam(data);
+}
+
+void memory_finish_oam_dma()
+{
+}
+
+bool memory_dma_blocks(WORD address)
+{
+    (void)address;
+    return false;
+}
+#endif
+// Rebuilds what the game sees of page from _memory_map_table
+static void _memory_refresh_page(int page)
+{
+    _memory_pages.read_pages[page] = _memory_map_table.read_pages[page];
+    _memory_pages.write_pages[page] = _memory_map_table.write_pages[page];
+    _memory_pages.read_handlers[page] = _memory_map_table.read_handlers[page];
+    _memory_pages.write_handlers[page] = _memory_map_table.write_handlers[page];
+#ifdef MEMORY_ACCURATE_DMA
+    if (_memory_dma_active && page < 0xFF)
+    {
+        _memory_pages.read_pages[page] = NULL;
+        _memory_pages.write_pages[page] = NULL;
+        _memory_pages.read_handlers[page] = _memory_read_blocked;
+        _memory_pages.write_handlers[page] = _memory_write_blocked;
+    }
+#endif
+    if (_memory_watched_pages[page] & MEMORY_WATCH_READ)
+    {
+        _memory_pages.read_pages[page] = NULL;
+        _memory_pages.read_handlers[page] = _memory_read_watched;
+    }
+    if (_memory_watched_pages[page] & MEMORY_WATCH_WRITE)
+    {
+        _memory_pages.write_pages[page] = NULL;
+        _memory_pages.write_handlers[page] = _memory_write_watched;
+    }
+}
+
+static void _memory_watch_hit(WORD address, BYTE data, int access)
+{
+    for (int i = 0; i < MEMORY_WATCHPOINTS_MAX; i++)
+    {
+        struct memory_watchpoint *watchpoint = &_memory_watchpoints[i];
+        if (watchpoint->used && (watchpoint->access & access) && address >= watchpoint->first &&
+            address <= watchpoint->last)
         {
-            in_boot = false;
+            if (watchpoint->callback != NULL)
+            {
+                watchpoint->callback(address, data, access);
+            }
+            else
+            {
+                printf("Watchpoint %d: %s %04X = %02X\n", i,
+                       access == MEMORY_WATCH_READ ? "read" : access == MEMORY_WATCH_WRITE ? "write" : "execute",
+                       address, data);
+            }
         }
     }
-    return memory[address];
 }
 
-// For context, refer to http://www.codeslinger.co.uk/pages/projects/gameboy/dma.html
-static void _memory_dma_transfer(BYTE data)
+// The access goes where it would without the watchpoint, DMA blocking included
+static BYTE _memory_read_watched(WORD address)
 {
-    WORD address = data << 8; // source address is data * 100
-    for (int i = 0; i < 0xA0; i++)
+    int page = address >> 8;
+    BYTE data;
+    if (_memory_map_table.read_pages[page] != NULL)
+    {
+        data = _memory_map_table.read_pages[page][address & 0xFF];
+    }
+    else
+    {
+        data = _memory_map_table.read_handlers[page](address);
+    }
+#ifdef MEMORY_ACCURATE_DMA
+    if (_memory_dma_active && page < 0xFF)
+    {
+        data = _memory_read_blocked(address);
+    }
+#endif
+    _memory_watch_hit(address, data, MEMORY_WATCH_READ);
+    return data;
+}
+
+static void _memory_write_watched(WORD address, BYTE data)
+{
+    int page = address >> 8;
+    _memory_watch_hit(address, data, MEMORY_WATCH_WRITE);
+#ifdef MEMORY_ACCURATE_DMA
+    if (_memory_dma_active && page < 0xFF)
     {
-        memory_write(0xFE00 + i, memory_read(address + i));
+        return;
     }
-}
\ No newline at end of file
+#endif
+    if (_memory_map_table.write_pages[page] != NULL)
+    {
+        _memory_map_table.write_pages[page][address & 0xFF] = data;
+    }
+    else
+    {
+        _memory_map_table.write_handlers[page](address, data);
+    }
+}
+
+// Blocks are split at watched instructions when they are decoded, so adding or removing an execute watchpoint has to
+// flush them even when its page was already watched for execution
+static void _memory_update_watched_pages(bool execute)
+{
+    for (int page = 0; page < MEMORY_PAGES; page++)
+    {
+        BYTE before = _memory_watched_pages[page];
+        _memory_watched_pages[page] = 0;
+        for (int i = 0; i < MEMORY_WATCHPOINTS_MAX; i++)
+        {
+            struct memory_watchpoint *watchpoint = &_memory_watchpoints[i];
+            if (watchpoint->used && (watchpoint->first >> 8) <= page && page <= (watchpoint->last >> 8))
+            {
+                _memory_watched_pages[page] |= watchpoint->access;
+            }
+        }
+        if (_memory_watched_pages[page] != before)
+        {
+            _memory_refresh_page(page);
+        }
+    }
+    if (execute)
+    {
+        cpu_flush_code_cache();
+    }
+}
+
+int memory_add_watchpoint(WORD first, WORD last, int access, memory_watch_callback callback)
+{
+    assert(first <= last);
+    for (int i = 0; i < MEMORY_WATCHPOINTS_MAX; i++)
+    {
+        if (!_memory_watchpoints[i].used)
+        {
+            _memory_watchpoints[i].used = true;
+            _memory_watchpoints[i].first = first;
+            _memory_watchpoints[i].last = last;
+            _memory_watchpoints[i].access = access;
+            _memory_watchpoints[i].callback = callback;
+            _memory_update_watched_pages(access & MEMORY_WATCH_EXECUTE);
+            return i;
+        }
+    }
+    printf("No room for another watchpoint\n");
+    return -1;
+}
+
+void memory_remove_watchpoint(int watchpoint)
+{
+    assert(watchpoint >= 0 && watchpoint < MEMORY_WATCHPOINTS_MAX);
+    _memory_watchpoints[watchpoint].used = false;
+    _memory_update_watched_pages(_memory_watchpoints[watchpoint].access & MEMORY_WATCH_EXECUTE);
+}
+
+bool memory_execute_watched(WORD address)
+{
+    if (!(_memory_watched_pages[address >> 8] & MEMORY_WATCH_EXECUTE))
+    {
+        return false;
+    }
+    for (int i = 0; i < MEMORY_WATCHPOINTS_MAX; i++)
+    {
+        struct memory_watchpoint *watchpoint = &_memory_watchpoints[i];
+        if (watchpoint->used && (watchpoint->access & MEMORY_WATCH_EXECUTE) && address >= watchpoint->first &&
+            address <= watchpoint->last)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+void memory_watch_execute(WORD address)
+{
+    _memory_watch_hit(address, memory_direct_read(address), MEMORY_WATCH_EXECUTE);
+}
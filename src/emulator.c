@@ -5,16 +5,17 @@
 
 #include "emulator.h"
 #include "em_memory.h"
+#include "cartridge.h"
 #include "graphics.h"
 #include "common.h"
+#include "scheduler.h"
+#include "idle_loops.h"
 
 static struct emulator_context _emulator;
 
-// Temp count!!!!/////////////////////
-static int temp_count = 0;
-static long long total_cyles = 0;
-// Temp count!!!!/////////////////////
-static void _emulator_update_timers(int cycles);
+static void _emulator_timer_event();
+static void _emulator_serial_event();
+static void _emulator_dma_event();
 static void _emulator_handle_interrupts();
 static void _emulator_service_interrupt(BYTE bit_to_service);
 
@@ -41,31 +42,36 @@ static bool _sdl_init()
     SDL_RenderClear(_emulator.renderer);
 
     assert(_emulator.renderer);
+
+    // Frames are uploaded whole and stretched over the window, nearest neighbour keeps the pixels sharp
+    SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, "nearest");
+    _emulator.screen = SDL_CreateTexture(_emulator.renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING,
+                                         SCREEN_WIDTH, SCREEN_HEIGHT);
+    if (_emulator.screen == NULL)
+    {
+        printf("error creating the screen texture: %s\n", SDL_GetError());
+        return false;
+    }
+    _emulator.frame = (uint32_t *)calloc(SCREEN_HEIGHT * SCREEN_WIDTH, sizeof(uint32_t));
+    assert(_emulator.frame);
     return true;
 }
 
 static void _sdl_destroy()
 {
+    free(_emulator.frame);
+    _emulator.frame = NULL;
+    SDL_DestroyTexture(_emulator.screen);
+    SDL_DestroyRenderer(_emulator.renderer);
     SDL_DestroyWindow(_emulator.window);
 }
 
-// Each frame, render the pixels
+// Each frame, upload the pixels in one go and let SDL scale them to the window
 static void _sdl_render()
 {
-    for (int x = 0; x < SCREEN_WIDTH; x++)
-    {
-        for (int y = 0; y < SCREEN_HEIGHT; y++)
-        {
-            // Set RGB value for the display pixel
-            SDL_SetRenderDrawColor(_emulator.renderer, graphics_get_screen_data(y, x, 0), graphics_get_screen_data(y, x, 1), graphics_get_screen_data(y, x, 2), 175);
-            SDL_Rect r;
-            r.x = x * PIXEL_MULTIPLIER;
-            r.y = y * PIXEL_MULTIPLIER;
-            r.w = PIXEL_MULTIPLIER;
-            r.h = PIXEL_MULTIPLIER;
-            SDL_RenderFillRect(_emulator.renderer, &r);
-        }
-    }
+    graphics_convert_frame(_emulator.frame);
+    SDL_UpdateTexture(_emulator.screen, NULL, _emulator.frame, SCREEN_WIDTH * sizeof(uint32_t));
+    SDL_RenderCopy(_emulator.renderer, _emulator.screen, NULL, NULL);
     SDL_RenderPresent(_emulator.renderer);
 }
 
@@ -87,6 +93,8 @@ static bool _emulator_init()
 {
     memset(&_emulator, 0, sizeof(_emulator));
     _emulator.timer_clocks_per_increment = 1024;
+    _emulator.save_flush_frames = SAVE_FLUSH_FRAMES;
+    scheduler_init();
 
     if (!_sdl_init())
     {
@@ -99,9 +107,25 @@ static bool _emulator_init()
 
 static void _emulator_destroy()
 {
+    cartridge_close();
     _sdl_destroy();
 }
 
+// Extends cycles the CPU already ran by whole iterations of an idle loop, up to the next event or the end of the frame
+static int _emulator_idle_skip(int cycles, int idle_cycles, int frame_cycles_left)
+{
+    int skip = scheduler_cycles_until_next() - cycles;
+    if (skip > frame_cycles_left - cycles)
+    {
+        skip = frame_cycles_left - cycles;
+    }
+    if (skip > 0)
+    {
+        cycles += (skip + idle_cycles - 1) / idle_cycles * idle_cycles;
+    }
+    return cycles;
+}
+
 static void _emulator_update()
 {
     _sdl_poll_quit();
@@ -115,26 +139,54 @@ static void _emulator_update()
     // Run CYCLES_PER_FRAME clock cycles before rendering to screen
     while (cycles_this_update < CYCLES_PER_FRAME)
     {
-        // Replace with cycles for next opcode
-        int cycles = 4;
-        if (!_emulator.halted)
+        int cycles;
+        if (_emulator.halted)
+        {
+            // Nothing runs until an interrupt is requested and only events request them, so skip straight to the next
+            // one. Step normally while an EI/DI is still pending.
+            cycles = 4;
+            if (_emulator.enable_pending == 0 && _emulator.disable_pending == 0)
+            {
+                cycles = scheduler_cycles_until_next();
+                if (cycles > CYCLES_PER_FRAME - cycles_this_update)
+                {
+                    cycles = CYCLES_PER_FRAME - cycles_this_update;
+                }
+            }
+        }
+        else if (_emulator.idle_loop_cycles > 0)
         {
-            cycles = cpu_next_execute_instruction();
-            temp_print_registers();
+            // Spinning on RAM, skip whole iterations event by event until an interrupt handler runs
+            cycles = _emulator_idle_skip(0, _emulator.idle_loop_cycles, CYCLES_PER_FRAME - cycles_this_update);
         }
-        cycles_this_update += cycles;
-        total_cyles += cycles;
-        // printf("Executed, clock = %lld (+%d)\n", total_cyles, cycles);
-        ////////////////////////////////////////////////////
-        //    blarggs test - serial output
-        if (memory_direct_read(0xff02) == 0x81)
+        else
         {
-            char c = memory_direct_read(0xff01);
-            printf("%c", c);
+            // The CPU runs freely until the next peripheral event. A pending EI/DI takes effect after the next
+            // instruction, so only run a single one until it has.
+            int budget = scheduler_cycles_until_next();
+            if (_emulator.enable_pending > 0 || _emulator.disable_pending > 0)
+            {
+                budget = 1;
+            }
+            else if (budget > CYCLES_PER_FRAME - cycles_this_update)
+            {
+                budget = CYCLES_PER_FRAME - cycles_this_update;
+            }
+            cycles = cpu_run(budget);
 
-            memory_direct_write(0xff02, 0x0);
+            // Spinning in an idle loop, nothing changes until the next event so skip whole iterations up to it
+            bool until_interrupt;
+            int idle_cycles = cpu_idle_cycles(&until_interrupt);
+            if (idle_cycles > 0)
+            {
+                cycles = _emulator_idle_skip(cycles, idle_cycles, CYCLES_PER_FRAME - cycles_this_update);
+                if (until_interrupt)
+                {
+                    _emulator.idle_loop_cycles = idle_cycles;
+                }
+            }
         }
-        ////////////////////////////////////////////////////
+        cycles_this_update += cycles;
         if (_emulator.disable_pending > 0)
         {
             _emulator.disable_pending -= 1;
@@ -151,14 +203,16 @@ static void _emulator_update()
                 _emulator.master_interupt = true;
             }
         }
-        _emulator_update_timers(cycles);
-        graphics_update(cycles);
+        scheduler_advance(cycles);
         _emulator_handle_interrupts();
     }
-    // printf("Rendering\n");
     _sdl_render();
-    // assert(temp_count != 10);
-    temp_count += 1;
+}
+
+// Cartridge clocks follow emulated time in turbo mode, so in-game time keeps pace with the game and not the host
+static long long _emulator_emulated_seconds()
+{
+    return scheduler_now() / CPU_CLOCK_SPEED;
 }
 
 // Main emulator loop
@@ -170,27 +224,67 @@ void emulator_run(int argc, char **argv)
         return;
     }
 
-    // Temporary load rom function
-    assert(argc > 1);
-    BYTE *m_CartridgeMemory = (BYTE *)malloc(0x200000 * sizeof(BYTE));
-    memset(m_CartridgeMemory, 0, (0x200000 * sizeof(BYTE)));
-
-    BYTE *boot = (BYTE *)malloc(0x100 * sizeof(BYTE));
-    memset(boot, 0, (0x100 * sizeof(BYTE)));
+    // Options can go anywhere, what is left is the rom and the optional boot rom
+    const char *paths[2] = {NULL, NULL};
+    int path_count = 0;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--turbo") == 0)
+        {
+            _emulator.turbo = true;
+        }
+        else if (strcmp(argv[i], "--save-flush") == 0 && i + 1 < argc)
+        {
+            _emulator.save_flush_frames = atoi(argv[++i]);
+        }
+        else if (path_count < 2)
+        {
+            paths[path_count++] = argv[i];
+        }
+    }
+    assert(path_count > 0);
+    cartridge_set_clock(_emulator.turbo ? _emulator_emulated_seconds : cartridge_host_clock);
 
-    FILE *in;
-    in = fopen(argv[1], "rb");
-    fread(m_CartridgeMemory, 1, 0x200000, in);
-    fclose(in);
-    in = fopen(argv[2], "rb");
-    fread(boot, 1, 0x100, in);
-    fclose(in);
+    // Without a boot rom the emulator starts from the state it would have left
+    BYTE *boot = NULL;
+    if (paths[1] != NULL)
+    {
+        boot = (BYTE *)calloc(0x100, sizeof(BYTE));
+        FILE *in = fopen(paths[1], "rb");
+        size_t read = in ? fread(boot, 1, 0x100, in) : 0;
+        if (in)
+        {
+            fclose(in);
+        }
+        if (read != 0x100)
+        {
+            printf("Could not read the boot rom %s\n", paths[1]);
+            _sdl_destroy();
+            return;
+        }
+    }
 
-    memory_init(m_CartridgeMemory, boot);
+    // ROM and external RAM belong to the cartridge, this only backs the rest of the address space
+    BYTE *address_space = (BYTE *)calloc(0x10000, sizeof(BYTE));
+    memory_init(address_space, boot);
+    if (!cartridge_load(paths[0]))
+    {
+        _sdl_destroy();
+        return;
+    }
     cpu_intialize();
+    if (boot == NULL)
+    {
+        memory_skip_boot();
+        cpu_skip_boot();
+        // DIV carries on from the value the boot rom leaves
+        _emulator.divider_start = -memory_direct_read(DIVIDER_REGISTER_ADDRESS) * DIVIDER_CLOCK_CYCLES;
+    }
+    idle_loops_load(IDLE_LOOP_DATABASE, cartridge_rom());
 
     // Infinite loop that runs until the user closes the window
     // Runs FRAME_RATE times a second
+    int frames_since_flush = 0;
     while (!_emulator.quit)
     {
         const uint64_t ms_per_frame = 1000 / FRAME_RATE;
@@ -200,9 +294,14 @@ void emulator_run(int argc, char **argv)
         // _emulator_update is called FRAME_RATE times a second
         // After CYCLES_PER_FRAME clock cycles, renders screen
         _emulator_update();
+        if (_emulator.save_flush_frames > 0 && ++frames_since_flush >= _emulator.save_flush_frames)
+        {
+            cartridge_flush_save(false);
+            frames_since_flush = 0;
+        }
         uint64_t frame_time = SDL_GetTicks64() - frame_start;
 
-        if (frame_time < ms_per_frame)
+        if (frame_time < ms_per_frame && !_emulator.turbo)
         {
             uint32_t delay_for = ms_per_frame - frame_time;
             SDL_Delay(delay_for);
@@ -212,22 +311,27 @@ void emulator_run(int argc, char **argv)
     _emulator_destroy();
 }
 
+// Pending counters are decremented once per cpu_run, so the CPU has to hand back control right after EI/DI
 void emulator_disable_interupts()
 {
     _emulator.disable_pending = 2;
+    cpu_end_run();
 }
 
 void emulator_enable_interrupts()
 {
     _emulator.enable_pending = 2;
+    cpu_end_run();
 }
 // Set the requested interrupt bit at the interrupt register
 void emulator_request_interrupts(BYTE interrupt_bit)
 {
-    BYTE req = memory_read(INTERRUPT_REGISTER_ADDRESS);
+    BYTE req = memory_direct_read(INTERRUPT_REGISTER_ADDRESS);
     bit_set(&req, interrupt_bit);
-    memory_write(INTERRUPT_REGISTER_ADDRESS, req);
+    memory_direct_write(INTERRUPT_REGISTER_ADDRESS, req);
     _emulator.halted = false;
+    // The direct write skips the register's handler, stop the run here so the interrupt is serviced
+    cpu_end_run();
 }
 static void _emulator_handle_interrupts()
 {
@@ -238,7 +342,7 @@ static void _emulator_handle_interrupts()
     }
 
     // Check if an interrupt is present
-    BYTE interrupt_register = memory_read(INTERRUPT_REGISTER_ADDRESS);
+    BYTE interrupt_register = memory_direct_read(INTERRUPT_REGISTER_ADDRESS);
     if (interrupt_register > 0)
     {
         // Service the highest priority interrupt, lower bit == higher priority
@@ -247,7 +351,7 @@ static void _emulator_handle_interrupts()
             if (bit_test(interrupt_register, bit))
             {
                 // check if interrupt is enabled in Interupt Enabled Register at 0xFFFF
-                BYTE enabledReg = memory_read(0xFFFF);
+                BYTE enabledReg = memory_direct_read(0xFFFF);
                 if (bit_test(enabledReg, bit))
                 {
                     _emulator_service_interrupt(bit);
@@ -260,6 +364,7 @@ static void _emulator_handle_interrupts()
 void emulator_enable_interrupts_immediate()
 {
     _emulator.master_interupt = true;
+    cpu_end_run();
 }
 static void _emulator_service_interrupt(BYTE bit_to_service)
 {
@@ -285,6 +390,7 @@ static void _emulator_service_interrupt(BYTE bit_to_service)
     }
 
     _emulator.master_interupt = false;
+    _emulator.idle_loop_cycles = 0;
     cpu_interrupt(interrupt_address);
 
     BYTE interrupts = memory_direct_read(INTERRUPT_REGISTER_ADDRESS);
@@ -292,52 +398,101 @@ static void _emulator_service_interrupt(BYTE bit_to_service)
     memory_direct_write(INTERRUPT_REGISTER_ADDRESS, interrupts);
 }
 
-static void _emulator_update_timers(int cycles)
+// TIMA counts up from timer_value every timer_clocks_per_increment since timer_start, reloading from TMA as it wraps.
+// The overflow event normally restarts it first, a read can only land past it in the run that is due to fire it.
+static BYTE _emulator_timer_now()
 {
-    // Bit 2 is if timer is enabled
-
-    // Bit 0 and 1 give the frequency of the timer
-    // 00: 4096 Hz
-    // 01: 262144 Hz
-    // 10: 65536 Hz
-    // 11: 16384 Hzu
-    BYTE timer_controller = memory_direct_read(TIMER_CONTROLLER_ADDRESS);
-
-    _emulator.divider += cycles;
+    if (!_emulator.timer_enabled)
+    {
+        return _emulator.timer_value;
+    }
+    long long value = _emulator.timer_value +
+                      (scheduler_now() - _emulator.timer_start) / _emulator.timer_clocks_per_increment;
+    if (value > 0xFF)
+    {
+        BYTE reload = memory_direct_read(TMA);
+        value = reload + (value - 0x100) % (0x100 - reload);
+    }
+    return value;
+}
 
-    // Bit 2 of timer_contoller checks if timer is enabled
-    if (bit_test(timer_controller, 2))
+// TIMA holds value from start on, the only event is the overflow that requests the interrupt
+static void _emulator_start_timer(BYTE value, long long start)
+{
+    _emulator.timer_value = value;
+    _emulator.timer_start = start;
+    if (!_emulator.timer_enabled)
     {
-        // Timer is enabled
-        _emulator.timer += cycles;
+        scheduler_cancel(SCHEDULER_TIMER);
+        return;
+    }
+    long long overflow = start + (0x100 - value) * _emulator.timer_clocks_per_increment;
+    scheduler_schedule(SCHEDULER_TIMER, overflow - scheduler_now(), _emulator_timer_event);
+}
 
-        // time to increment the timer register
-        if (_emulator.timer >= _emulator.timer_clocks_per_increment)
-        {
-            _emulator.timer = 0;
+static void _emulator_timer_event()
+{
+    _emulator_start_timer(memory_direct_read(TMA), scheduler_now());
+    emulator_request_interrupts(TIMER_INTERRUPT);
+}
 
-            // Timer is about to overflow
-            if (memory_direct_read(TIMA) == 0XFF)
-            {
-                memory_direct_write(TIMA, memory_direct_read(TMA));
-                // request the interupt
-                emulator_request_interrupts(2);
-            }
-            else
-            {
-                BYTE cur_timer_val = memory_direct_read(TIMA);
-                memory_direct_write(TIMA, cur_timer_val + 1);
-            }
-        }
-    }
+BYTE emulator_read_timer()
+{
+    cpu_reset_idle();
+    return _emulator_timer_now();
+}
 
-    // update divider register if enough clock cycles
-    if (_emulator.divider >= 255)
+// Only the count changes, the next increment is still due when it would have been
+void emulator_write_timer(BYTE data)
+{
+    long long now = scheduler_now();
+    long long start = now;
+    if (_emulator.timer_enabled)
     {
-        _emulator.divider = 0;
-        BYTE divider_reg_value = memory_direct_read(DIVIDER_REGISTER_ADDRESS);
-        memory_direct_write(DIVIDER_REGISTER_ADDRESS, divider_reg_value + 1);
+        start -= (now - _emulator.timer_start) % _emulator.timer_clocks_per_increment;
     }
+    _emulator_start_timer(data, start);
+}
+
+BYTE emulator_read_divider()
+{
+    cpu_reset_idle();
+    return (scheduler_now() - _emulator.divider_start) / DIVIDER_CLOCK_CYCLES;
+}
+
+// The game zeroed DIV, its next increment is a whole period away
+void emulator_reset_divider()
+{
+    _emulator.divider_start = scheduler_now();
+}
+
+// Transfer finished, nothing is on the other end of the link so there is no data coming back
+static void _emulator_serial_event()
+{
+    BYTE control = memory_direct_read(SERIAL_CONTROL_ADDRESS);
+    bit_reset(&control, 7);
+    memory_direct_write(SERIAL_CONTROL_ADDRESS, control);
+}
+
+void emulator_start_serial_transfer()
+{
+    ////////////////////////////////////////////////////
+    //    blarggs test - serial output
+    char c = memory_direct_read(SERIAL_DATA_ADDRESS);
+    printf("%c", c);
+    ////////////////////////////////////////////////////
+    scheduler_schedule(SCHEDULER_SERIAL, SERIAL_TRANSFER_CYCLES, _emulator_serial_event);
+}
+
+static void _emulator_dma_event()
+{
+    memory_finish_oam_dma();
+}
+
+// Counted from the DMA_ADDRESS write, not from the start of the run it happened in
+void emulator_start_oam_dma()
+{
+    scheduler_schedule(SCHEDULER_DMA, DMA_TRANSFER_CYCLES, _emulator_dma_event);
 }
 
 int emulator_get_clock_speed()
@@ -345,12 +500,18 @@ int emulator_get_clock_speed()
     return _emulator.timer_clocks_per_increment;
 }
 
+// Restarts the timer at the new speed from the value it has reached, or stops it if the game disabled it
 void emulator_set_clock_speed(int new_speed)
 {
-    _emulator.timer = 0;
+    BYTE value = _emulator_timer_now();
     _emulator.timer_clocks_per_increment = new_speed;
+
+    // Bit 2 of timer_contoller checks if timer is enabled
+    _emulator.timer_enabled = bit_test(memory_direct_read(TIMER_CONTROLLER_ADDRESS), 2);
+    _emulator_start_timer(value, scheduler_now());
 }
 void emulator_halt()
 {
     _emulator.halted = true;
+    cpu_end_run();
 }
\ No newline at end of file
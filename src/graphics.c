@@ -3,162 +3,325 @@
 #include "em_memory.h"
 #include "graphics.h"
 #include "common.h"
+#include "scheduler.h"
+
+// x86 builds compose scanlines with SSE2, plus SSSE3 byte shuffles and AVX2 when the compiler targets them (make
+// AVX2=1). GRAPHICS_SCALAR forces the portable code, which every other architecture uses.
+#if defined(__SSE2__) && !defined(GRAPHICS_SCALAR)
+#define GRAPHICS_SSE2
+#include <emmintrin.h>
+#if defined(__SSSE3__)
+#define GRAPHICS_SSSE3
+#include <tmmintrin.h>
+#endif
+#if defined(__AVX2__)
+#define GRAPHICS_AVX2
+#include <immintrin.h>
+#endif
+#endif
 
 // All the following funtions have been heavily inspired by http://www.codeslinger.co.uk/pages/projects/gameboy/lcd.html
 struct graphics_context graphics;
 
+// Cycles spent searching OAM and transferring pixels at the start of each visible scanline, the rest is hblank
+#define GRAPHICS_MODE_2_CYCLES 80
+#define GRAPHICS_MODE_3_CYCLES 172
+
+// Every tile in VRAM decoded to one colour number per pixel, the second copy is mirrored for sprites flipped in x.
+// Tiles are decoded again when the game writes them, valid is false until the whole of VRAM has been decoded once.
+static BYTE _graphics_tiles[2][MEMORY_VRAM_TILES][8][8];
+static bool _graphics_tiles_valid;
+
+// Colour indices of the scanline being drawn. Sprites are blended in at their x position wrapped to a byte, so the line
+// is wide enough for any of them and only the first 160 pixels are shown.
+#define GRAPHICS_LINE_SIZE (256 + 8)
+static BYTE _graphics_line[GRAPHICS_LINE_SIZE];
+
+// Each palette maps colour numbers straight to colour indices and is rebuilt when its register is written. Background
+// colour number 0 also carries GRAPHICS_BACKGROUND_COLOUR_0 for sprite priority.
+static BYTE _graphics_palettes[GRAPHICS_PALETTE_COUNT][4];
+
+// ARGB8888 for every colour index, also split by channel for the shuffles that convert a frame
+static uint32_t _graphics_argb[16];
+static BYTE _graphics_channels[3][16];
+
+static const BYTE _graphics_greys[4][3] = {{255, 255, 255}, {0xCC, 0xCC, 0xCC}, {0x77, 0x77, 0x77}, {0, 0, 0}};
+
 // helper graphics functions
-static void _graphics_set_lcd_status();
+static void _graphics_set_mode(BYTE mode);
+static void _graphics_compare_scanline();
+static void _graphics_start_scanline();
+static void _graphics_start_transfer();
+static void _graphics_start_hblank();
+static void _graphics_next_scanline();
 static void _graphics_draw_scanline();
 static bool _graphics_is_lcd_enabled();
+static void _graphics_decode_tile(int tile);
+static void _graphics_update_tiles();
 static void _graphics_render_background(BYTE lcd_control);
 static void _graphics_render_sprites(BYTE lcd_control);
-COLOUR _graphics_get_colour(BYTE colourNum, WORD address);
+static void _graphics_update_palette(int palette, BYTE data);
+static void _graphics_apply_palette(BYTE *pixels, int count, const BYTE *palette);
+static void _graphics_blend_sprite(BYTE *line, const BYTE *colours, const BYTE *palette, bool behind);
 
 void graphics_init()
 {
     memset(&graphics, 0, sizeof(graphics));
-    graphics.scanline_counter = SCANLINE_CLOCK_CYCLES;
+    _graphics_tiles_valid = false;
+    for (int palette = 0; palette < GRAPHICS_PALETTE_COUNT; palette++)
+    {
+        graphics_set_colours(palette, _graphics_greys);
+        _graphics_update_palette(palette, 0x00);
+    }
 }
-void graphics_update(int cycles)
+
+void graphics_set_colours(enum graphics_palette palette, const BYTE colours[4][3])
 {
-    _graphics_set_lcd_status();
-    if (_graphics_is_lcd_enabled())
+    for (int shade = 0; shade < 4; shade++)
     {
-        graphics.scanline_counter -= cycles;
+        for (int channel = 0; channel < 3; channel++)
+        {
+            _graphics_channels[channel][palette * 4 + shade] = colours[shade][channel];
+        }
+        _graphics_argb[palette * 4 + shade] =
+            0xFF000000u | (colours[shade][0] << 16) | (colours[shade][1] << 8) | colours[shade][2];
     }
+}
 
-    if (graphics.scanline_counter <= 0)
+// The PPU only starts once the game turns the LCD on, from then on each mode change is a scheduler event
+void graphics_register_written(WORD address)
+{
+    if (address == LCD_CONTROL_ADDRESS)
     {
-        // increment scanline
-        BYTE prev_scanline = memory_direct_read(SCANLINE_ADDRESS);
-        memory_direct_write(SCANLINE_ADDRESS, prev_scanline + 1);
-
-        BYTE cur_scanline = memory_direct_read(SCANLINE_ADDRESS);
-
-        graphics.scanline_counter += SCANLINE_CLOCK_CYCLES;
-
-        // If reach end of visible scanlines, request a VBLANK interrupt
-        if (cur_scanline == VISIBLE_SCANLINES)
+        bool enabled = _graphics_is_lcd_enabled();
+        if (enabled == graphics.lcd_enabled)
         {
-            emulator_request_interrupts(VBLANK_INTERRUPT);
+            return;
         }
-        else if (cur_scanline > TOTAL_SCANLINES)
+        graphics.lcd_enabled = enabled;
+
+        if (enabled)
         {
-            // Start scanlines from 0
-            memory_direct_write(SCANLINE_ADDRESS, 0);
+            _graphics_start_scanline();
         }
-        else if (cur_scanline < VISIBLE_SCANLINES)
+        else
         {
-            // Draw current scanline
-            _graphics_draw_scanline();
+            scheduler_cancel(SCHEDULER_PPU);
+            memory_direct_write(SCANLINE_ADDRESS, 0);
+
+            // must set LCD mode to 1 for some games to work
+            BYTE status = memory_direct_read(LCD_STATUS_ADDRESS);
+            status &= 252;
+            bit_set(&status, 0);
+            memory_direct_write(LCD_STATUS_ADDRESS, status);
         }
     }
+    else if (address == LCD_COMPARE_ADDRESS && graphics.lcd_enabled)
+    {
+        _graphics_compare_scanline();
+    }
+    else if (address >= BACKGROUND_PALETTE_ADDRESS && address <= SPRITE_PALETTE_1_ADDRESS)
+    {
+        _graphics_update_palette(address - BACKGROUND_PALETTE_ADDRESS, memory_direct_read(address));
+    }
 }
 
-static void _graphics_set_lcd_status()
+// Switch the mode bits of the status register, modes 0, 1 and 2 can request an interrupt when entered
+static void _graphics_set_mode(BYTE mode)
 {
-    BYTE status = memory_read(LCD_STATUS_ADDRESS);
+    BYTE status = memory_direct_read(LCD_STATUS_ADDRESS);
 
-    if (!_graphics_is_lcd_enabled())
+    status = (status & 252) | mode;
+    memory_direct_write(LCD_STATUS_ADDRESS, status);
+    if (mode != 3 && bit_test(status, 3 + mode))
     {
-        // must set LCD mode to 1 for some games to work
-        graphics.scanline_counter = SCANLINE_CLOCK_CYCLES;
-        memory_direct_write(SCANLINE_ADDRESS, 0);
+        emulator_request_interrupts(LCD_INTERRUPT);
+    }
+}
 
-        // & sets mode to 1
-        status &= 252;
-        bit_set(&status, 0);
-        memory_direct_write(LCD_STATUS_ADDRESS, status);
-        return;
+// check the conincidence flag, the interrupt is only requested when LY starts matching
+static void _graphics_compare_scanline()
+{
+    BYTE status = memory_direct_read(LCD_STATUS_ADDRESS);
+
+    if (memory_direct_read(SCANLINE_ADDRESS) == memory_direct_read(LCD_COMPARE_ADDRESS))
+    {
+        if (!bit_test(status, 2) && bit_test(status, 6))
+        {
+            emulator_request_interrupts(LCD_INTERRUPT);
+        }
+        bit_set(&status, 2);
+    }
+    else
+    {
+        bit_reset(&status, 2);
     }
+    memory_direct_write(LCD_STATUS_ADDRESS, status);
+}
 
+static void _graphics_start_scanline()
+{
     BYTE cur_scanline = memory_direct_read(SCANLINE_ADDRESS);
-    BYTE current_mode = status & 0x3;
 
-    BYTE mode = 0;
-    bool req_interrupt = false;
+    _graphics_compare_scanline();
+    if (cur_scanline < VISIBLE_SCANLINES)
+    {
+        // mode 2, searching OAM
+        _graphics_set_mode(2);
+        scheduler_schedule(SCHEDULER_PPU, GRAPHICS_MODE_2_CYCLES, _graphics_start_transfer);
+        return;
+    }
 
     // in vblank so set mode to 1
-    if (cur_scanline >= VISIBLE_SCANLINES)
+    if (cur_scanline == VISIBLE_SCANLINES)
     {
-        mode = 1;
-        bit_set(&status, 0);
-        bit_reset(&status, 1);
-        req_interrupt = bit_test(status, 4);
+        _graphics_set_mode(1);
     }
-    else
-    {
-        int mode_2_bound = 456 - 80;
-        int mode_3_bound = mode_2_bound - 172;
+    scheduler_schedule(SCHEDULER_PPU, SCANLINE_CLOCK_CYCLES, _graphics_next_scanline);
+}
 
-        // mode 2
-        if (graphics.scanline_counter >= mode_2_bound)
-        {
-            mode = 2;
-            bit_set(&status, 1);
-            bit_reset(&status, 0);
-            req_interrupt = bit_test(status, 5);
-        }
-        // mode 3
-        else if (graphics.scanline_counter >= mode_3_bound)
-        {
-            mode = 3;
-            bit_set(&status, 1);
-            bit_set(&status, 0);
-        }
-        // mode 0
-        else
-        {
-            mode = 0;
-            bit_reset(&status, 1);
-            bit_reset(&status, 0);
-            req_interrupt = bit_test(status, 3);
-        }
-    }
+// mode 3, transferring pixels to the screen
+static void _graphics_start_transfer()
+{
+    _graphics_set_mode(3);
+    scheduler_schedule(SCHEDULER_PPU, GRAPHICS_MODE_3_CYCLES, _graphics_start_hblank);
+}
 
-    // just entered a new mode so request interupt
-    if (req_interrupt && (mode != current_mode))
-        emulator_request_interrupts(LCD_INTERRUPT);
+// mode 0, horizontal blank until the next scanline
+static void _graphics_start_hblank()
+{
+    _graphics_set_mode(0);
+    scheduler_schedule(SCHEDULER_PPU, SCANLINE_CLOCK_CYCLES - GRAPHICS_MODE_2_CYCLES - GRAPHICS_MODE_3_CYCLES,
+                       _graphics_next_scanline);
+}
 
-    // check the conincidence flag
-    if (cur_scanline == memory_read(0xFF45))
+static void _graphics_next_scanline()
+{
+    // increment scanline
+    BYTE prev_scanline = memory_direct_read(SCANLINE_ADDRESS);
+    memory_direct_write(SCANLINE_ADDRESS, prev_scanline + 1);
+
+    BYTE cur_scanline = memory_direct_read(SCANLINE_ADDRESS);
+
+    // If reach end of visible scanlines, request a VBLANK interrupt
+    if (cur_scanline == VISIBLE_SCANLINES)
     {
-        bit_set(&status, 2);
-        if (bit_test(status, 6))
-        {
-            emulator_request_interrupts(LCD_INTERRUPT);
-        }
+        emulator_request_interrupts(VBLANK_INTERRUPT);
     }
-    else
+    else if (cur_scanline > TOTAL_SCANLINES)
     {
-        bit_reset(&status, 2);
+        // Start scanlines from 0
+        memory_direct_write(SCANLINE_ADDRESS, 0);
     }
-    memory_write(LCD_STATUS_ADDRESS, status);
+    else if (cur_scanline < VISIBLE_SCANLINES)
+    {
+        // Draw current scanline
+        _graphics_draw_scanline();
+    }
+    _graphics_start_scanline();
 }
 
 static void _graphics_draw_scanline()
 {
-    BYTE lcd_control = memory_read(LCD_CONTROL_ADDRESS);
+    BYTE lcd_control = memory_direct_read(LCD_CONTROL_ADDRESS);
 
     // draw scanline if lcd is enabled
     if (_graphics_is_lcd_enabled())
     {
+        _graphics_update_tiles();
         _graphics_render_background(lcd_control);
         _graphics_render_sprites(lcd_control);
+        memcpy(graphics.screen_data[memory_direct_read(SCANLINE_ADDRESS)], _graphics_line, 160);
     }
 }
 
 static bool _graphics_is_lcd_enabled()
 {
-    return bit_test(memory_read(LCD_CONTROL_ADDRESS), 7);
+    return bit_test(memory_direct_read(LCD_CONTROL_ADDRESS), 7);
+}
+
+static void _graphics_decode_tile(int tile)
+{
+    WORD address = 0x8000 + tile * 16;
+    BYTE(*pixels)[8] = _graphics_tiles[0][tile];
+
+#ifdef GRAPHICS_SSE2
+    // Two rows at a time, each bitplane byte is repeated across 8 lanes and tested against one bit per lane
+    const __m128i bits = _mm_setr_epi8(0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01, 0x80, 0x40, 0x20, 0x10, 0x08,
+                                       0x04, 0x02, 0x01);
+    // Unsigned, spreading a byte of 0x80 or more would overflow a long long
+    const uint64_t lanes = 0x0101010101010101ULL;
+    for (int row = 0; row < 8; row += 2)
+    {
+        __m128i low = _mm_set_epi64x((long long)(lanes * memory_direct_read(address + row * 2 + 2)),
+                                     (long long)(lanes * memory_direct_read(address + row * 2)));
+        __m128i high = _mm_set_epi64x((long long)(lanes * memory_direct_read(address + row * 2 + 3)),
+                                      (long long)(lanes * memory_direct_read(address + row * 2 + 1)));
+        low = _mm_and_si128(_mm_cmpeq_epi8(_mm_and_si128(low, bits), bits), _mm_set1_epi8(1));
+        high = _mm_and_si128(_mm_cmpeq_epi8(_mm_and_si128(high, bits), bits), _mm_set1_epi8(2));
+        _mm_storeu_si128((__m128i *)pixels[row], _mm_or_si128(low, high));
+    }
+#else
+    for (int row = 0; row < 8; row++)
+    {
+        BYTE data1 = memory_direct_read(address + row * 2);
+        BYTE data2 = memory_direct_read(address + row * 2 + 1);
+
+        for (int x = 0; x < 8; x++)
+        {
+            int colourBit = 7 - x;
+            pixels[row][x] = (bit_get(data2, colourBit) << 1) | bit_get(data1, colourBit);
+        }
+    }
+#endif
+
+    for (int row = 0; row < 8; row++)
+    {
+        for (int x = 0; x < 8; x++)
+        {
+            _graphics_tiles[1][tile][row][7 - x] = pixels[row][x];
+        }
+    }
+}
+
+// Decodes the tiles written since the last scanline
+static void _graphics_update_tiles()
+{
+    struct memory_vram_dirty dirty;
+
+    memory_take_vram_dirty(&dirty);
+    if (!_graphics_tiles_valid)
+    {
+        for (int tile = 0; tile < MEMORY_VRAM_TILES; tile++)
+        {
+            _graphics_decode_tile(tile);
+        }
+        _graphics_tiles_valid = true;
+        return;
+    }
+    if (!dirty.any)
+    {
+        return;
+    }
+    for (int group = 0; group < MEMORY_VRAM_TILES / 8; group++)
+    {
+        for (int tile = 0; dirty.tiles[group] != 0; tile++)
+        {
+            if (bit_test(dirty.tiles[group], tile))
+            {
+                bit_reset(&dirty.tiles[group], tile);
+                _graphics_decode_tile(group * 8 + tile);
+            }
+        }
+    }
 }
 
 static void _graphics_render_background(BYTE lcd_control)
 {
-    // Check if background is enabled
+    // Check if background is enabled, without it the line is blank and sprites always show
     if (!bit_test(lcd_control, LCD_BACKGROUND_ENABLED_BIT))
     {
+        memset(_graphics_line, GRAPHICS_BACKGROUND_COLOUR_0, GRAPHICS_LINE_SIZE);
         return;
     }
 
@@ -167,16 +330,16 @@ static void _graphics_render_background(BYTE lcd_control)
     bool unsig = true;
 
     // Which 160X144 of the 256X256 pixels to draw, that is where are the viewing area and window located
-    BYTE viewing_area_start_y = memory_read(0xFF42);
-    BYTE viewing_area_start_x = memory_read(0xFF43);
-    BYTE window_start_y = memory_read(0xFF4A);
-    BYTE window_start_x = memory_read(0xFF4B) - 7;
+    BYTE viewing_area_start_y = memory_direct_read(0xFF42);
+    BYTE viewing_area_start_x = memory_direct_read(0xFF43);
+    BYTE window_start_y = memory_direct_read(0xFF4A);
+    BYTE window_start_x = memory_direct_read(0xFF4B) - 7;
 
     bool using_window = false;
 
     if (bit_test(lcd_control, LCD_WINDOW_ENABLED_BIT))
     {
-        if (window_start_y <= memory_read(0xFF44))
+        if (window_start_y <= memory_direct_read(0xFF44))
             using_window = true;
     }
     else
@@ -227,104 +390,52 @@ static void _graphics_render_background(BYTE lcd_control)
     // current scanline is drawing
     if (!using_window)
     {
-        yPos = viewing_area_start_y + memory_read(0xFF44);
+        yPos = viewing_area_start_y + memory_direct_read(0xFF44);
     }
     else
     {
-        yPos = memory_read(0xFF44) - window_start_y;
+        yPos = memory_direct_read(0xFF44) - window_start_y;
     }
 
     WORD tileRow = (((BYTE)(yPos / 8)) * 32);
 
-    for (int pixel = 0; pixel < 160; pixel++)
+    // A tile row at a time, from xPos up to the end of the tile or the window edge
+    for (int pixel = 0; pixel < 160;)
     {
         BYTE xPos = pixel + viewing_area_start_x;
+        int count = 8 - xPos % 8;
 
         if (using_window)
         {
             if (pixel >= window_start_x)
             {
                 xPos = pixel - window_start_x;
+                count = 8 - xPos % 8;
+            }
+            else if (pixel + count > window_start_x)
+            {
+                count = window_start_x - pixel;
             }
         }
-
         WORD tile_col = (xPos / 8);
         SIGNED_WORD tile_num;
 
         if (unsig)
         {
-            tile_num = (BYTE)memory_read(background_tile_id_location + tileRow + tile_col);
+            tile_num = (BYTE)memory_direct_read(background_tile_id_location + tileRow + tile_col);
         }
         else
         {
-            tile_num = (SIGNED_BYTE)memory_read(background_tile_id_location + tileRow + tile_col);
-        }
-
-        WORD tile_location = tile_data_vram_location;
-
-        if (unsig)
-        {
-            tile_location += (tile_num * 16);
-        }
-        else
-        {
-            tile_location += ((tile_num + 128) * 16);
-        }
-
-        BYTE line = yPos % 8;
-        line *= 2;
-        BYTE data1 = memory_read(tile_location + line);
-        BYTE data2 = memory_read(tile_location + line + 1);
-
-        int colourBit = xPos % 8;
-        colourBit -= 7;
-        colourBit *= -1;
-
-        int colourNum = bit_get(data2, colourBit);
-        colourNum <<= 1;
-        colourNum |= bit_get(data1, colourBit);
-
-        COLOUR col = _graphics_get_colour(colourNum, 0xFF47);
-        int red = 0;
-        int green = 0;
-        int blue = 0;
-
-        switch (col)
-        {
-        case WHITE:
-            red = 255;
-            green = 255;
-            blue = 255;
-            break;
-        case LIGHT_GRAY:
-            red = 0xCC;
-            green = 0xCC;
-            blue = 0xCC;
-            break;
-        case DARK_GRAY:
-            red = 0x77;
-            green = 0x77;
-            blue = 0x77;
-            break;
-        case BLACK:
-            red = 0;
-            green = 0;
-            blue = 0;
-            break;
+            tile_num = (SIGNED_BYTE)memory_direct_read(background_tile_id_location + tileRow + tile_col);
         }
 
-        int final_y = memory_read(0xFF44);
-
-        if ((final_y < 0) || (final_y > 143) || (pixel < 0) || (pixel > 159))
-        {
-            assert(false);
-            continue;
-        }
-
-        graphics.screen_data[final_y][pixel][0] = red;
-        graphics.screen_data[final_y][pixel][1] = green;
-        graphics.screen_data[final_y][pixel][2] = blue;
+        // Signed tile numbers count from the middle of the 0x8800 block
+        int tile = (tile_data_vram_location - 0x8000) / 16 + (unsig ? tile_num : tile_num + 128);
+        // Always a whole 8 bytes, anything past count is overwritten by the next tile or lands in the hidden part
+        memcpy(&_graphics_line[pixel], &_graphics_tiles[0][tile][yPos % 8][xPos % 8], 8);
+        pixel += count;
     }
+    _graphics_apply_palette(_graphics_line, 160, _graphics_palettes[GRAPHICS_BACKGROUND_PALETTE]);
 }
 
 static void _graphics_render_sprites(BYTE lcd_control)
@@ -343,15 +454,15 @@ static void _graphics_render_sprites(BYTE lcd_control)
     for (int sprite = 0; sprite < 40; sprite++)
     {
         BYTE index = sprite * 4;
-        BYTE yPos = memory_read(0xFE00 + index) - 16;
-        BYTE xPos = memory_read(0xFE00 + index + 1) - 8;
-        BYTE tileLocation = memory_read(0xFE00 + index + 2);
-        BYTE attributes = memory_read(0xFE00 + index + 3);
+        BYTE yPos = memory_direct_read(0xFE00 + index) - 16;
+        BYTE xPos = memory_direct_read(0xFE00 + index + 1) - 8;
+        BYTE tileLocation = memory_direct_read(0xFE00 + index + 2);
+        BYTE attributes = memory_direct_read(0xFE00 + index + 3);
 
         bool yFlip = bit_test(attributes, 6);
         bool xFlip = bit_test(attributes, 5);
 
-        int scanline = memory_read(0xFF44);
+        int scanline = memory_direct_read(0xFF44);
 
         int ysize = 8;
 
@@ -368,141 +479,139 @@ static void _graphics_render_sprites(BYTE lcd_control)
                 line *= -1;
             }
 
-            line *= 2;
-            BYTE data1 = memory_read((0x8000 + (tileLocation * 16)) + line);
-            BYTE data2 = memory_read((0x8000 + (tileLocation * 16)) + line + 1);
-
-            for (int tilePixel = 7; tilePixel >= 0; tilePixel--)
-            {
-                int colourbit = tilePixel;
-                if (xFlip)
-                {
-                    colourbit -= 7;
-                    colourbit *= -1;
-                }
-                int colourNum = bit_get(data2, colourbit);
-                colourNum <<= 1;
-                colourNum |= bit_get(data1, colourbit);
-
-                COLOUR col = _graphics_get_colour(colourNum, bit_test(attributes, 4) ? 0xFF49 : 0xFF48);
-
-                // white is transparent for sprites.
-                if (col == WHITE)
-                    continue;
-
-                int red = 0;
-                int green = 0;
-                int blue = 0;
-
-                switch (col)
-                {
-                case WHITE:
-                    red = 255;
-                    green = 255;
-                    blue = 255;
-                    break;
-                case LIGHT_GRAY:
-                    red = 0xCC;
-                    green = 0xCC;
-                    blue = 0xCC;
-                    break;
-                case DARK_GRAY:
-                    red = 0x77;
-                    green = 0x77;
-                    blue = 0x77;
-                    break;
-                case BLACK:
-                    red = 0;
-                    green = 0;
-                    blue = 0;
-                    break;
-                }
-
-                int xPix = 0 - tilePixel;
-                xPix += 7;
-
-                int pixel = xPos + xPix;
-
-                if ((scanline < 0) || (scanline > 143) || (pixel < 0) || (pixel > 159))
-                {
-                    //	assert(false) ;
-                    continue;
-                }
-
-                // check if pixel is hidden behind background
-                if (bit_test(attributes, 7) == 1)
-                {
-                    if ((graphics.screen_data[scanline][pixel][0] != 255) || (graphics.screen_data[scanline][pixel][1] != 255) || (graphics.screen_data[scanline][pixel][2] != 255))
-                        continue;
-                }
-
-                graphics.screen_data[scanline][pixel][0] = red;
-                graphics.screen_data[scanline][pixel][1] = green;
-                graphics.screen_data[scanline][pixel][2] = blue;
-            }
+            // Tall sprites carry on into the following tile
+            _graphics_blend_sprite(&_graphics_line[xPos], _graphics_tiles[xFlip][tileLocation + line / 8][line % 8],
+                                   _graphics_palettes[bit_test(attributes, 4) ? GRAPHICS_SPRITE_PALETTE_1
+                                                                              : GRAPHICS_SPRITE_PALETTE_0],
+                                   bit_test(attributes, 7));
         }
     }
 }
 
-COLOUR _graphics_get_colour(BYTE colourNum, WORD address)
+// data is the value written to the palette register, two bits of shade per colour number
+static void _graphics_update_palette(int palette, BYTE data)
+{
+    for (int colour = 0; colour < 4; colour++)
+    {
+        _graphics_palettes[palette][colour] = palette * 4 + ((data >> (colour * 2)) & 0x3);
+    }
+    if (palette == GRAPHICS_BACKGROUND_PALETTE)
+    {
+        _graphics_palettes[palette][0] |= GRAPHICS_BACKGROUND_COLOUR_0;
+    }
+}
+
+#ifdef GRAPHICS_SSE2
+// Looks up 16 colour numbers in the four colour indices of a palette
+static inline __m128i _graphics_palette_lookup(__m128i colours, const BYTE *palette)
 {
-    COLOUR res = WHITE;
-    BYTE palette = memory_read(address);
-    int hi = 0;
-    int lo = 0;
-
-    // which bits of the colour palette does the colour id map to?
-    switch (colourNum)
-    {
-    case 0:
-        hi = 1;
-        lo = 0;
-        break;
-    case 1:
-        hi = 3;
-        lo = 2;
-        break;
-    case 2:
-        hi = 5;
-        lo = 4;
-        break;
-    case 3:
-        hi = 7;
-        lo = 6;
-        break;
-    default:
-        assert(false);
-        break;
-    }
-
-    // use the palette to get the colour
-    int colour = 0;
-    colour = bit_get(palette, hi) << 1;
-    colour |= bit_get(palette, lo);
-
-    switch (colour)
-    {
-    case 0:
-        res = WHITE;
-        break;
-    case 1:
-        res = LIGHT_GRAY;
-        break;
-    case 2:
-        res = DARK_GRAY;
-        break;
-    case 3:
-        res = BLACK;
-        break;
-    default:
-        assert(false);
-        break;
-    }
-
-    return res;
+#ifdef GRAPHICS_SSSE3
+    return _mm_shuffle_epi8(_mm_setr_epi8(palette[0], palette[1], palette[2], palette[3], 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+                                          0),
+                            colours);
+#else
+    __m128i result = _mm_setzero_si128();
+    for (int colour = 0; colour < 4; colour++)
+    {
+        __m128i match = _mm_cmpeq_epi8(colours, _mm_set1_epi8(colour));
+        result = _mm_or_si128(result, _mm_and_si128(match, _mm_set1_epi8(palette[colour])));
+    }
+    return result;
+#endif
 }
+#endif
 
-BYTE graphics_get_screen_data(int col, int row, int colour)
+// Replaces count colour numbers with the colour indices palette gives them
+static void _graphics_apply_palette(BYTE *pixels, int count, const BYTE *palette)
 {
-    return graphics.screen_data[col][row][colour];
+    int pixel = 0;
+
+#ifdef GRAPHICS_AVX2
+    const __m256i table = _mm256_setr_epi8(palette[0], palette[1], palette[2], palette[3], 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+                                           0, 0, palette[0], palette[1], palette[2], palette[3], 0, 0, 0, 0, 0, 0, 0, 0,
+                                           0, 0, 0, 0);
+    for (; pixel + 32 <= count; pixel += 32)
+    {
+        __m256i colours = _mm256_loadu_si256((const __m256i *)&pixels[pixel]);
+        _mm256_storeu_si256((__m256i *)&pixels[pixel], _mm256_shuffle_epi8(table, colours));
+    }
+#endif
+#ifdef GRAPHICS_SSE2
+    for (; pixel + 16 <= count; pixel += 16)
+    {
+        __m128i colours = _mm_loadu_si128((const __m128i *)&pixels[pixel]);
+        _mm_storeu_si128((__m128i *)&pixels[pixel], _graphics_palette_lookup(colours, palette));
+    }
+#endif
+    for (; pixel < count; pixel++)
+    {
+        pixels[pixel] = palette[pixels[pixel]];
+    }
+}
+
+// Draws the 8 colour numbers of a sprite row over the line through palette. Colour number 0 is transparent, and a
+// sprite behind the background only shows where the background has colour number 0.
+static void _graphics_blend_sprite(BYTE *line, const BYTE *colours, const BYTE *palette, bool behind)
+{
+#ifdef GRAPHICS_SSE2
+    const __m128i zero = _mm_setzero_si128();
+    __m128i background = _mm_loadl_epi64((const __m128i *)line);
+    __m128i sprite = _mm_loadl_epi64((const __m128i *)colours);
+
+    // All ones in the lanes where the line keeps its own pixel
+    __m128i hidden = _mm_cmpeq_epi8(sprite, zero);
+    if (behind)
+    {
+        __m128i covered = _mm_cmpeq_epi8(_mm_and_si128(background, _mm_set1_epi8(GRAPHICS_BACKGROUND_COLOUR_0)), zero);
+        hidden = _mm_or_si128(hidden, covered);
+    }
+    sprite = _graphics_palette_lookup(sprite, palette);
+    background = _mm_or_si128(_mm_and_si128(hidden, background), _mm_andnot_si128(hidden, sprite));
+    _mm_storel_epi64((__m128i *)line, background);
+#else
+    for (int pixel = 0; pixel < 8; pixel++)
+    {
+        if (colours[pixel] != 0 && (!behind || (line[pixel] & GRAPHICS_BACKGROUND_COLOUR_0)))
+        {
+            line[pixel] = palette[colours[pixel]];
+        }
+    }
+#endif
+}
+
+void graphics_convert_frame(uint32_t *pixels)
+{
+    const BYTE *indices = &graphics.screen_data[0][0];
+    int pixel = 0;
+
+#ifdef GRAPHICS_SSSE3
+    // Each channel is looked up for 16 pixels at once and the bytes interleaved into B, G, R, A order. The shuffles
+    // only use the low four bits of an index, so the background flag drops out.
+    __m128i tables[3];
+    for (int channel = 0; channel < 3; channel++)
+    {
+        tables[channel] = _mm_loadu_si128((const __m128i *)_graphics_channels[channel]);
+    }
+    const __m128i alpha = _mm_set1_epi8(-1);
+    for (; pixel + 16 <= SCREEN_HEIGHT * SCREEN_WIDTH; pixel += 16)
+    {
+        __m128i index = _mm_loadu_si128((const __m128i *)&indices[pixel]);
+        __m128i red = _mm_shuffle_epi8(tables[0], index);
+        __m128i green = _mm_shuffle_epi8(tables[1], index);
+        __m128i blue = _mm_shuffle_epi8(tables[2], index);
+        __m128i blue_green[2] = {_mm_unpacklo_epi8(blue, green), _mm_unpackhi_epi8(blue, green)};
+        __m128i red_alpha[2] = {_mm_unpacklo_epi8(red, alpha), _mm_unpackhi_epi8(red, alpha)};
+        for (int half = 0; half < 2; half++)
+        {
+            _mm_storeu_si128((__m128i *)&pixels[pixel + half * 8],
+                             _mm_unpacklo_epi16(blue_green[half], red_alpha[half]));
+            _mm_storeu_si128((__m128i *)&pixels[pixel + half * 8 + 4],
+                             _mm_unpackhi_epi16(blue_green[half], red_alpha[half]));
+        }
+    }
+#endif
+    for (; pixel < SCREEN_HEIGHT * SCREEN_WIDTH; pixel++)
+    {
+        pixels[pixel] = _graphics_argb[indices[pixel] & 0xF];
+    }
 }
@@ -0,0 +1,29 @@
+#include <stdio.h>
+#include "idle_loops.h"
+#include "cpu.h"
+
+void idle_loops_load(const char *path, const BYTE *cartridge)
+{
+    FILE *in = fopen(path, "r");
+    if (!in)
+    {
+        return;
+    }
+
+    unsigned int header_checksum = cartridge[0x14D];
+    unsigned int global_checksum = (cartridge[0x14E] << 8) | cartridge[0x14F];
+    char line[256];
+    while (fgets(line, sizeof(line), in))
+    {
+        unsigned int header, global, bank, address;
+        if (line[0] == '#' || sscanf(line, "%x %x %x %x", &header, &global, &bank, &address) != 4)
+        {
+            continue;
+        }
+        if (header == header_checksum && global == global_checksum)
+        {
+            cpu_add_idle_loop(address, bank);
+        }
+    }
+    fclose(in);
+}
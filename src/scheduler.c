@@ -0,0 +1,95 @@
+#include <assert.h>
+#include <limits.h>
+#include <string.h>
+#include "cpu.h"
+#include "scheduler.h"
+
+struct scheduler_entry
+{
+    bool pending;
+    long long deadline;
+    scheduler_callback callback;
+};
+
+struct scheduler_context
+{
+    long long now;
+    struct scheduler_entry events[SCHEDULER_EVENT_COUNT];
+
+    // Earliest pending event, recomputed whenever a deadline changes. There are only a handful of events so a scan
+    // is cheaper than keeping a heap.
+    int next;
+};
+
+static struct scheduler_context _scheduler;
+
+static void _scheduler_find_next()
+{
+    _scheduler.next = -1;
+    for (int event = 0; event < SCHEDULER_EVENT_COUNT; event++)
+    {
+        if (_scheduler.events[event].pending &&
+            (_scheduler.next < 0 || _scheduler.events[event].deadline < _scheduler.events[_scheduler.next].deadline))
+        {
+            _scheduler.next = event;
+        }
+    }
+}
+
+void scheduler_init()
+{
+    memset(&_scheduler, 0, sizeof(_scheduler));
+    _scheduler.next = -1;
+}
+
+// The clock only moves between runs, inside one the cpu is cpu_run_elapsed ahead of it
+long long scheduler_now()
+{
+    return _scheduler.now + cpu_run_elapsed();
+}
+
+void scheduler_schedule(enum scheduler_event event, int cycles_from_now, scheduler_callback callback)
+{
+    assert(cycles_from_now > 0);
+    _scheduler.events[event].pending = true;
+    _scheduler.events[event].deadline = scheduler_now() + cycles_from_now;
+    _scheduler.events[event].callback = callback;
+    _scheduler_find_next();
+}
+
+void scheduler_cancel(enum scheduler_event event)
+{
+    _scheduler.events[event].pending = false;
+    _scheduler_find_next();
+}
+
+bool scheduler_is_pending(enum scheduler_event event)
+{
+    return _scheduler.events[event].pending;
+}
+
+int scheduler_cycles_until_next()
+{
+    if (_scheduler.next < 0)
+    {
+        return INT_MAX;
+    }
+    long long cycles = _scheduler.events[_scheduler.next].deadline - _scheduler.now;
+    return cycles < 1 ? 1 : (int)cycles;
+}
+
+void scheduler_advance(int cycles)
+{
+    long long target = _scheduler.now + cycles;
+
+    while (_scheduler.next >= 0 && _scheduler.events[_scheduler.next].deadline <= target)
+    {
+        struct scheduler_entry *entry = &_scheduler.events[_scheduler.next];
+
+        _scheduler.now = entry->deadline;
+        entry->pending = false;
+        _scheduler_find_next();
+        entry->callback();
+    }
+    _scheduler.now = target;
+}
@@ -0,0 +1,100 @@
+// Checks cartridge banking against images built on the fly, run with make test
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "config.h"
+#include "cartridge.h"
+#include "cpu.h"
+#include "em_memory.h"
+#include "emulator.h"
+#include "graphics.h"
+
+// Stand ins for the emulator, nothing here runs the cpu
+void emulator_disable_interupts() {}
+void emulator_enable_interrupts() {}
+void emulator_enable_interrupts_immediate() {}
+void emulator_request_interrupts(BYTE interrupt_bit) { (void)interrupt_bit; }
+int emulator_get_clock_speed() { return 1024; }
+void emulator_set_clock_speed(int new_speed) { (void)new_speed; }
+void emulator_halt() {}
+void emulator_start_serial_transfer() {}
+void emulator_start_oam_dma() { memory_finish_oam_dma(); }
+BYTE emulator_read_divider() { return 0; }
+void emulator_reset_divider() {}
+BYTE emulator_read_timer() { return 0; }
+void emulator_write_timer(BYTE data) { (void)data; }
+void graphics_register_written(WORD address) { (void)address; }
+
+// Room for the .sav name _test_unload makes from it
+static char _test_path[sizeof("/tmp/cartridge_test_XXXXXX.sav")];
+
+// Writes a 32KB ROM with the given header type and RAM size to a temporary file and loads it
+static void _test_load(BYTE type, BYTE ram_size)
+{
+    static BYTE rom[0x8000];
+    rom[CARTRIDGE_TYPE_ADDRESS] = type;
+    rom[CARTRIDGE_ROM_SIZE_ADDRESS] = 0x00;
+    rom[CARTRIDGE_RAM_SIZE_ADDRESS] = ram_size;
+
+    strcpy(_test_path, "/tmp/cartridge_test_XXXXXX.gb");
+    int fd = mkstemps(_test_path, 3);
+    assert(fd >= 0);
+    assert(write(fd, rom, sizeof(rom)) == sizeof(rom));
+    close(fd);
+
+    memory_init((BYTE *)calloc(0x10000, sizeof(BYTE)), NULL);
+    assert(cartridge_load(_test_path));
+}
+
+// Closes the cartridge and removes the ROM and any save it made
+static void _test_unload()
+{
+    cartridge_close();
+    unlink(_test_path);
+    strcpy(&_test_path[strlen(_test_path) - 3], ".sav");
+    unlink(_test_path);
+}
+
+// All 16 RAM banks of a 128KB MBC5 cart hold their own data, banks 8 and up included
+static void _test_mbc5_ram_banks()
+{
+    _test_load(0x1A, 0x04);
+    memory_write(0x0000, 0x0A);
+    for (int bank = 0; bank < 16; bank++)
+    {
+        memory_write(0x4000, bank);
+        memory_write(0xA000, 0x40 + bank);
+        memory_write(0xBFFF, 0x80 + bank);
+    }
+    for (int bank = 0; bank < 16; bank++)
+    {
+        memory_write(0x4000, bank);
+        assert(memory_read(0xA000) == 0x40 + bank);
+        assert(memory_read(0xBFFF) == 0x80 + bank);
+    }
+    _test_unload();
+}
+
+// On MBC3 banks 0x08 and up are the clock, never RAM
+static void _test_mbc3_rtc_banks()
+{
+    _test_load(0x10, 0x03);
+    memory_write(0x0000, 0x0A);
+    memory_write(0x4000, 0x00);
+    memory_write(0xA000, 0x12);
+    memory_write(0x4000, 0x08);
+    memory_write(0xA000, 0x05);
+    memory_write(0x4000, 0x00);
+    assert(memory_read(0xA000) == 0x12);
+    _test_unload();
+}
+
+int main()
+{
+    _test_mbc5_ram_banks();
+    _test_mbc3_rtc_banks();
+    printf("cartridge tests passed\n");
+    return 0;
+}
@@ -0,0 +1,114 @@
+// Checks that events the game starts in the middle of a cpu_run count from the write, run with make test
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "config.h"
+#include "cpu.h"
+#include "em_memory.h"
+#include "emulator.h"
+#include "graphics.h"
+#include "scheduler.h"
+
+// Stand ins for the emulator, the timer only counts its ticks and DMA is timed like the emulator does
+static int _test_clock_speed = 1024;
+static int _test_timer_ticks = 0;
+
+static void _test_timer_event()
+{
+    _test_timer_ticks += 1;
+    scheduler_schedule(SCHEDULER_TIMER, _test_clock_speed, _test_timer_event);
+}
+
+static void _test_dma_event()
+{
+    memory_finish_oam_dma();
+}
+
+void emulator_disable_interupts() { cpu_end_run(); }
+void emulator_enable_interrupts() { cpu_end_run(); }
+void emulator_enable_interrupts_immediate() { cpu_end_run(); }
+void emulator_request_interrupts(BYTE interrupt_bit) { (void)interrupt_bit; }
+int emulator_get_clock_speed() { return _test_clock_speed; }
+void emulator_set_clock_speed(int new_speed)
+{
+    _test_clock_speed = new_speed;
+    scheduler_schedule(SCHEDULER_TIMER, new_speed, _test_timer_event);
+}
+void emulator_halt() { cpu_end_run(); }
+void emulator_start_serial_transfer() {}
+void emulator_start_oam_dma() { scheduler_schedule(SCHEDULER_DMA, DMA_TRANSFER_CYCLES, _test_dma_event); }
+BYTE emulator_read_divider() { return 0; }
+void emulator_reset_divider() {}
+BYTE emulator_read_timer() { return 0; }
+void emulator_write_timer(BYTE data) { (void)data; }
+void graphics_register_written(WORD address) { (void)address; }
+
+// Runs code placed at 0xC000 for up to cycle_budget cycles and lets the events it scheduled fall due
+static int _test_run(const BYTE *code, int size, int cycle_budget)
+{
+    memory_init((BYTE *)calloc(0x10000, sizeof(BYTE)), NULL);
+    scheduler_init();
+    cpu_intialize();
+    cpu_skip_boot();
+    for (int i = 0; i < size; i++)
+    {
+        memory_write(0xC000 + i, code[i]);
+    }
+    // JP 0xC000 from the entry point, the rest of WRAM is NOPs
+    memory_direct_write(0x0100, 0xC3);
+    memory_direct_write(0x0101, 0x00);
+    memory_direct_write(0x0102, 0xC0);
+
+    int cycles = cpu_run(cycle_budget);
+    scheduler_advance(cycles);
+    return cycles;
+}
+
+// The 16 cycle timer selected 300 cycles into a 400 cycle run ticks over the last 100 cycles only
+static void _test_timer_from_write()
+{
+    BYTE code[80] = {0};
+    code[71] = 0x3E; // LD A,0x05
+    code[72] = 0x05;
+    code[73] = 0xE0; // LDH (TAC),A
+    code[74] = TIMER_CONTROLLER_ADDRESS & 0xFF;
+
+    _test_timer_ticks = 0;
+    int cycles = _test_run(code, sizeof(code), 400);
+    // JP then 71 NOPs and the LD come before the write
+    int written = 16 + 71 * 4 + 8;
+    assert(_test_timer_ticks == (cycles - written) / 16);
+}
+
+#ifdef MEMORY_ACCURATE_DMA
+// A DMA started 300 cycles into a run keeps memory from the cpu for DMA_TRANSFER_CYCLES from the write, the write
+// ends the run
+static void _test_dma_from_write()
+{
+    BYTE code[80] = {0};
+    code[71] = 0x3E; // LD A,0xC1
+    code[72] = 0xC1;
+    code[73] = 0xE0; // LDH (DMA),A
+    code[74] = DMA_ADDRESS & 0xFF;
+
+    int cycles = _test_run(code, sizeof(code), 400);
+    int written = 16 + 71 * 4 + 8;
+    assert(cycles == written + 12);
+    assert(memory_dma_blocks(0xC000));
+    assert(scheduler_cycles_until_next() == DMA_TRANSFER_CYCLES - 12);
+    scheduler_advance(DMA_TRANSFER_CYCLES - 13);
+    assert(memory_dma_blocks(0xC000));
+    scheduler_advance(1);
+    assert(!memory_dma_blocks(0xC000));
+}
+#endif
+
+int main()
+{
+    _test_timer_from_write();
+#ifdef MEMORY_ACCURATE_DMA
+    _test_dma_from_write();
+#endif
+    printf("scheduler tests passed\n");
+    return 0;
+}